@@ -0,0 +1,82 @@
+/*
+ * Benchmark: per-keypress keybinding lookup cost.
+ *
+ * Populates the keybinding index with 10, 100 and 1000 bindings and times
+ * lookups against it. The old linear scan over a GPtrArray is timed on the
+ * same bindings for comparison. No X server is needed.
+ */
+
+#define KEYNAV_NO_MAIN
+#include "../keynav.c"
+
+#include <time.h>
+
+#define LOOKUPS (1000000)
+
+static const int modmasks[] = {
+  0, ShiftMask, ControlMask, Mod1Mask, Mod4Mask,
+  ShiftMask | ControlMask, ControlMask | Mod1Mask,
+};
+#define NMODMASKS (sizeof(modmasks) / sizeof(*modmasks))
+
+static double elapsed_ns(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) * 1e9
+         + (end->tv_nsec - start->tv_nsec);
+}
+
+static void bench(int nbindings) {
+  GPtrArray *linear = g_ptr_array_new();
+  struct timespec start, end;
+  volatile int found = 0;
+  int i;
+
+  keybindings = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                      NULL, keybinding_free);
+  for (i = 0; i < nbindings; i++) {
+    int keycode = 8 + (i % 248);
+    int mods = modmasks[(i / 248) % NMODMASKS];
+    addbinding(keycode, mods, "cut-left");
+    g_ptr_array_add(linear, keybinding_lookup(keycode, mods));
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < LOOKUPS; i++) {
+    int n = i % nbindings;
+    if (keybinding_lookup(8 + (n % 248), modmasks[(n / 248) % NMODMASKS]))
+      found++;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("bindings=%-5d hashed: %7.1f ns/lookup\n", nbindings,
+         elapsed_ns(&start, &end) / LOOKUPS);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < LOOKUPS; i++) {
+    int n = i % nbindings;
+    int keycode = 8 + (n % 248);
+    int mods = modmasks[(n / 248) % NMODMASKS];
+    int j;
+    for (j = 0; j < linear->len; j++) {
+      keybinding_t *kbt = g_ptr_array_index(linear, j);
+      if (kbt->keycode == keycode && kbt->mods == mods) {
+        found++;
+      }
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("bindings=%-5d linear: %7.1f ns/lookup\n", nbindings,
+         elapsed_ns(&start, &end) / LOOKUPS);
+
+  g_ptr_array_free(linear, TRUE);
+  g_hash_table_destroy(keybindings);
+}
+
+int main(int argc, char **argv) {
+  startkeys = g_ptr_array_new();
+  recordings = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                     NULL, recording_free);
+
+  bench(10);
+  bench(100);
+  bench(1000);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,365 @@
+/*
+ * Benchmark: end-to-end latency against a real keynav.
+ *
+ * Meant to run under Xvfb through bench/e2e.sh, which provides a known
+ * keynavrc. Starts keynav repeatedly to time a cold start up to the point
+ * its grabs are in place, then types start, cut, warp and click sequences
+ * through XTest and times how long each takes to show up on the X server.
+ *
+ * Results are printed as one JSON object per line so runs from different
+ * builds can be compared.
+ */
+
+#define KEYNAV_NO_MAIN
+#include "../keynav.c"
+
+#include <X11/extensions/XTest.h>
+
+#define ITERATIONS_DEFAULT (50)
+#define STARTS (10)
+#define START_TIMEOUT_US (5000000)
+#define EVENT_TIMEOUT_US (1000000)
+#define READY_POLL_US (200)
+
+typedef struct samples {
+  const char *metric;
+  long long *values;
+  int n;
+  int timeouts;
+} samples_t;
+
+static KeyCode key_control;
+static KeyCode key_start;   /* ctrl+semicolon start */
+static KeyCode key_cut;     /* h cut-left */
+static KeyCode key_warp;    /* semicolon warp,end */
+static KeyCode key_click;   /* space warp,click 1,end */
+
+static void samples_init(samples_t *s, const char *metric, int size) {
+  s->metric = metric;
+  s->values = calloc(size, sizeof(long long));
+  s->n = 0;
+  s->timeouts = 0;
+}
+
+static void samples_add(samples_t *s, long long start_us, long long end_us) {
+  if (end_us < 0) {
+    s->timeouts++;
+    return;
+  }
+  s->values[s->n++] = end_us - start_us;
+}
+
+static int value_cmp(const void *a, const void *b) {
+  long long va = *(const long long *)a;
+  long long vb = *(const long long *)b;
+  return (va > vb) - (va < vb);
+}
+
+static long long samples_percentile(const samples_t *s, int percent) {
+  if (s->n == 0)
+    return 0;
+  return s->values[(s->n - 1) * percent / 100];
+}
+
+static void samples_print(samples_t *s) {
+  qsort(s->values, s->n, sizeof(long long), value_cmp);
+  printf("{\"metric\":\"%s\",\"unit\":\"us\",\"n\":%d,\"timeouts\":%d,"
+         "\"p50\":%lld,\"p90\":%lld,\"p99\":%lld,\"max\":%lld}\n",
+         s->metric, s->n, s->timeouts,
+         samples_percentile(s, 50), samples_percentile(s, 90),
+         samples_percentile(s, 99), samples_percentile(s, 100));
+}
+
+/* Ask keynav for its status and wait for the reply. Returns 1 if it
+ * answered. */
+static int keynav_answers(const char *socket_path) {
+  struct timeval timeout = { 1, 0 };
+  char reply[256];
+  int fd, answered;
+
+  fd = control_connect(socket_path);
+  if (fd == -1)
+    return 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  answered = control_write(fd, "status", 6) && shutdown(fd, SHUT_WR) == 0
+             && read(fd, reply, sizeof(reply)) > 0;
+  close(fd);
+  return answered;
+}
+
+/* Start keynav and wait until its control socket answers a command.
+ * keynav only listens once its start keys are grabbed, so that is when a
+ * start key would first work. Returns the time that took, or -1. */
+static long long keynav_start(const char *keynav, const char *socket_path,
+                              pid_t *pid) {
+  long long start_us = now_us();
+
+  *pid = fork();
+  if (*pid == 0) {
+    execl(keynav, keynav, (char *)NULL);
+    _exit(127);
+  }
+  if (*pid == -1)
+    return -1;
+
+  while (now_us() - start_us < START_TIMEOUT_US) {
+    if (keynav_answers(socket_path))
+      return now_us();
+    if (waitpid(*pid, NULL, WNOHANG) == *pid) {
+      *pid = -1;
+      return -1;
+    }
+    usleep(READY_POLL_US);
+  }
+  return -1;
+}
+
+static void keynav_stop(pid_t pid) {
+  if (pid <= 0)
+    return;
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+  /* Make sure the server has dropped its grabs before the next start */
+  XSync(dpy, False);
+}
+
+static void key_tap(KeyCode keycode, int with_control) {
+  if (with_control)
+    XTestFakeKeyEvent(dpy, key_control, True, CurrentTime);
+  XTestFakeKeyEvent(dpy, keycode, True, CurrentTime);
+  XTestFakeKeyEvent(dpy, keycode, False, CurrentTime);
+  if (with_control)
+    XTestFakeKeyEvent(dpy, key_control, False, CurrentTime);
+  XFlush(dpy);
+}
+
+/* The window an event is about, rather than the one it was reported to */
+static Window event_window(const XEvent *e) {
+  switch (e->type) {
+    case MapNotify: return e->xmap.window;
+    case UnmapNotify: return e->xunmap.window;
+    case ConfigureNotify: return e->xconfigure.window;
+    default: return e->xany.window;
+  }
+}
+
+/* Read the next event, waiting until deadline_us at most. */
+static int next_event(XEvent *e, long long deadline_us) {
+  int xfd = ConnectionNumber(dpy);
+
+  while (!XPending(dpy)) {
+    long long left_us = deadline_us - now_us();
+    struct timeval tv;
+    fd_set fds;
+
+    if (left_us <= 0)
+      return -1;
+    tv.tv_sec = left_us / 1000000;
+    tv.tv_usec = left_us % 1000000;
+    FD_ZERO(&fds);
+    FD_SET(xfd, &fds);
+    select(xfd + 1, &fds, NULL, NULL, &tv);
+  }
+  XNextEvent(dpy, e);
+  return 0;
+}
+
+/* Wait for an event of the given type, about the given window unless it
+ * is None. Returns the time it arrived, or -1 on timeout. */
+static long long wait_event(int type, Window window, XEvent *e) {
+  long long deadline_us = now_us() + EVENT_TIMEOUT_US;
+
+  while (next_event(e, deadline_us) == 0) {
+    if (e->type == type && (window == None || event_window(e) == window))
+      return now_us();
+  }
+  return -1;
+}
+
+/* Wait for the overlay to be resized and, if keynav unmapped it to draw,
+ * for it to be mapped again. */
+static long long wait_frame(Window overlay) {
+  long long deadline_us = now_us() + EVENT_TIMEOUT_US;
+  int configured = 0;
+  int unmapped = 0;
+  XEvent e;
+
+  while (next_event(&e, deadline_us) == 0) {
+    if (event_window(&e) != overlay)
+      continue;
+    if (e.type == UnmapNotify)
+      unmapped = 1;
+    else if (e.type == MapNotify)
+      unmapped = 0;
+    else if (e.type == ConfigureNotify)
+      configured = 1;
+    if (configured && !unmapped)
+      return now_us();
+  }
+  return -1;
+}
+
+/* Poll the pointer until it leaves (x, y). */
+static long long wait_pointer_moved(int x, int y) {
+  long long deadline_us = now_us() + EVENT_TIMEOUT_US;
+  Window root, child;
+  int root_x, root_y, win_x, win_y;
+  unsigned int mask;
+
+  while (now_us() < deadline_us) {
+    XQueryPointer(dpy, DefaultRootWindow(dpy), &root, &child,
+                  &root_x, &root_y, &win_x, &win_y, &mask);
+    if (root_x != x || root_y != y)
+      return now_us();
+  }
+  return -1;
+}
+
+static void drain_events() {
+  XEvent e;
+
+  XSync(dpy, False);
+  while (XPending(dpy))
+    XNextEvent(dpy, &e);
+}
+
+/* Ask the keynav under test for its version, which need not match the
+ * keynav.c this benchmark was built from. */
+static char *keynav_version(const char *keynav) {
+  static char version[64] = "unknown";
+  char *command, *p;
+  FILE *fp;
+
+  if (asprintf(&command, "'%s' version", keynav) == -1)
+    return version;
+  fp = popen(command, "r");
+  free(command);
+  if (fp == NULL)
+    return version;
+  if (fscanf(fp, "keynav %63s", version) != 1)
+    strcpy(version, "unknown");
+  pclose(fp);
+  for (p = version; *p; p++) {
+    if (*p == '"' || *p == '\\')
+      *p = '_';
+  }
+  return version;
+}
+
+static void bench_cold_start(const char *keynav, const char *socket_path,
+                             int cached) {
+  samples_t s;
+  char *cache_path = config_cache_path();
+  int i;
+
+  samples_init(&s, cached ? "cold_start_cached" : "cold_start", STARTS);
+  for (i = 0; i < STARTS; i++) {
+    pid_t pid;
+    long long start_us;
+
+    if (!cached && cache_path != NULL)
+      unlink(cache_path);
+    start_us = now_us();
+    samples_add(&s, start_us, keynav_start(keynav, socket_path, &pid));
+    keynav_stop(pid);
+  }
+  samples_print(&s);
+  free(cache_path);
+}
+
+static void bench_latency(int iterations) {
+  samples_t start_to_mapped, cut_to_frame, keypress_to_warp,
+            keypress_to_click;
+  Window root = DefaultRootWindow(dpy);
+  XEvent e;
+  int i;
+
+  samples_init(&start_to_mapped, "start_to_mapped", iterations);
+  samples_init(&cut_to_frame, "keypress_to_frame", iterations);
+  samples_init(&keypress_to_warp, "keypress_to_warp", iterations);
+  samples_init(&keypress_to_click, "keypress_to_click", iterations);
+
+  XSelectInput(dpy, root, SubstructureNotifyMask | ButtonPressMask);
+
+  for (i = 0; i < iterations; i++) {
+    long long start_us, when_us;
+    Window overlay;
+
+    XTestFakeMotionEvent(dpy, -1, 0, 0, CurrentTime);
+    drain_events();
+
+    start_us = now_us();
+    key_tap(key_start, True);
+    when_us = wait_event(MapNotify, None, &e);
+    samples_add(&start_to_mapped, start_us, when_us);
+    if (when_us < 0)
+      continue;
+    overlay = e.xmap.window;
+
+    start_us = now_us();
+    key_tap(key_cut, False);
+    samples_add(&cut_to_frame, start_us, wait_frame(overlay));
+
+    /* Alternate between warping and clicking to leave keynav */
+    start_us = now_us();
+    if (i % 2 == 0) {
+      key_tap(key_warp, False);
+      samples_add(&keypress_to_warp, start_us, wait_pointer_moved(0, 0));
+    } else {
+      key_tap(key_click, False);
+      samples_add(&keypress_to_click, start_us,
+                  wait_event(ButtonPress, None, &e));
+    }
+    wait_event(UnmapNotify, overlay, &e);
+  }
+
+  samples_print(&start_to_mapped);
+  samples_print(&cut_to_frame);
+  samples_print(&keypress_to_warp);
+  samples_print(&keypress_to_click);
+}
+
+int main(int argc, char **argv) {
+  const char *keynav = (argc > 1 ? argv[1] : "./keynav");
+  int iterations = (argc > 2 ? atoi(argv[2]) : ITERATIONS_DEFAULT);
+  char *display_name = getenv("DISPLAY");
+  char *socket_path;
+  int ev, err, major, minor;
+  pid_t pid;
+
+  if (display_name == NULL || (dpy = XOpenDisplay(display_name)) == NULL) {
+    fprintf(stderr, "Can't open display\n");
+    return EXIT_FAILURE;
+  }
+  if (!XTestQueryExtension(dpy, &ev, &err, &major, &minor)) {
+    fprintf(stderr, "The X server has no XTest extension\n");
+    return EXIT_FAILURE;
+  }
+  socket_path = control_socket_path(display_name);
+  if (socket_path == NULL) {
+    fprintf(stderr, "Can't find the keynav control socket path\n");
+    return EXIT_FAILURE;
+  }
+
+  key_control = XKeysymToKeycode(dpy, XK_Control_L);
+  key_start = XKeysymToKeycode(dpy, XK_semicolon);
+  key_cut = XKeysymToKeycode(dpy, XK_h);
+  key_warp = key_start;
+  key_click = XKeysymToKeycode(dpy, XK_space);
+
+  printf("{\"keynav\":\"%s\",\"display\":\"%s\",\"iterations\":%d}\n",
+         keynav_version(keynav), display_name, iterations);
+
+  bench_cold_start(keynav, socket_path, 0);
+  bench_cold_start(keynav, socket_path, 1);
+
+  if (keynav_start(keynav, socket_path, &pid) < 0) {
+    fprintf(stderr, "keynav did not start\n");
+    return EXIT_FAILURE;
+  }
+  bench_latency(iterations);
+  keynav_stop(pid);
+
+  free(socket_path);
+  return EXIT_SUCCESS;
+}
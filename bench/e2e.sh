@@ -0,0 +1,48 @@
+#!/bin/sh
+# End-to-end latency benchmark. Starts Xvfb, gives keynav a known config
+# in a scratch HOME and runs bench/e2e against it. Results go to stdout as
+# one JSON object per line.
+#
+# Usage: bench/e2e.sh [keynav binary] [iterations]
+set -e
+
+KEYNAV=${1:-./keynav}
+ITERATIONS=${2:-50}
+DISPLAY_NUM=${DISPLAY_NUM:-4}
+
+tmp=$(mktemp -d)
+Xvfb :$DISPLAY_NUM -screen 0 1920x1080x24 -nolisten tcp \
+  >"$tmp/xvfb.log" 2>&1 &
+PID_XVFB=$!
+trap 'kill $PID_XVFB 2>/dev/null; rm -rf "$tmp"' EXIT INT TERM
+
+# Wait for the server socket instead of sleeping a fixed time
+tries=0
+while [ ! -S /tmp/.X11-unix/X$DISPLAY_NUM ]; do
+  tries=$((tries + 1))
+  if [ $tries -gt 500 ] || ! kill -0 $PID_XVFB 2>/dev/null; then
+    echo "Xvfb did not start:" >&2
+    cat "$tmp/xvfb.log" >&2
+    exit 1
+  fi
+  sleep 0.01
+done
+
+export DISPLAY=:$DISPLAY_NUM
+export HOME="$tmp"
+export XDG_CONFIG_HOME="$tmp/config"
+export XDG_CACHE_HOME="$tmp/cache"
+export XDG_RUNTIME_DIR="$tmp"
+
+# bench/e2e types exactly these keys
+mkdir -p "$XDG_CONFIG_HOME/keynav"
+cat > "$XDG_CONFIG_HOME/keynav/keynavrc" <<RC
+clear
+ctrl+semicolon start
+Escape end
+h cut-left
+semicolon warp,end
+space warp,click 1,end
+RC
+
+./bench/e2e "$KEYNAV" "$ITERATIONS"
@@ -0,0 +1,120 @@
+/*
+ * Benchmark: grid rendering cost.
+ *
+ * Renders grids from 2x2 up to 26x26 with labels at 1080p, 4K and 8K into
+ * cairo image surfaces and reports the time per frame, the clip rectangles
+ * the frame generates and an estimate of the bytes it touches. No X server
+ * is needed.
+ */
+
+#define KEYNAV_NO_MAIN
+#include "../keynav.c"
+
+#include <time.h>
+
+#define MIN_FRAMES (5)
+#define MIN_NS (200e6)
+#define BYTES_PER_PIXEL (4)
+
+static const struct { const char *name; int w; int h; } sizes[] = {
+  { "1080p", 1920, 1080 },
+  { "4k", 3840, 2160 },
+  { "8k", 7680, 4320 },
+};
+#define NSIZES (sizeof(sizes) / sizeof(*sizes))
+
+#define GRID_MIN (2)
+#define GRID_MAX (26)
+
+static double elapsed_ns(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) * 1e9
+         + (end->tv_nsec - start->tv_nsec);
+}
+
+/* Bytes a frame writes or reads: the background fill, one column or row of
+ * pixels per grid line, each label box, and each letter tile read from the
+ * atlas and written to the canvas. */
+static long long bytes_touched(const wininfo_t *info,
+                               const label_atlas_t *atlas) {
+  grid_labels_t *labels = grid_labels_get(info->grid_rows, info->grid_cols);
+  long long pixels = (long long)info->w * info->h;
+  int i;
+
+  pixels += (long long)(info->grid_cols + 1) * info->h;
+  pixels += (long long)(info->grid_rows + 1) * info->w;
+  for (i = 0; i < info->grid_rows * info->grid_cols; i++) {
+    int len;
+    if (labels->leaves[i] < 0)
+      continue;
+    len = labels->nodes[labels->leaves[i]].depth;
+    pixels += (long long)(len * atlas->glyph_w + 2 * LABEL_PAD_X)
+              * atlas->rectheight;
+    pixels += (long long)len * atlas->glyph_w * atlas->glyph_h * 2;
+  }
+  return pixels * BYTES_PER_PIXEL;
+}
+
+static void bench(const char *name, int w, int h, int grid,
+                  label_atlas_t *atlas) {
+  struct timespec start, end;
+  cairo_surface_t *surface;
+  cairo_t *cr;
+  wininfo_t info;
+  double ns;
+  int frames = 0;
+  int nrects = 0;
+  int i;
+
+  memset(&info, 0, sizeof(wininfo_t));
+  info.w = w;
+  info.h = h;
+  info.grid_rows = grid;
+  info.grid_cols = grid;
+  info.border_thickness = 3;
+
+  surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, w, h);
+  cr = cairo_create(surface);
+  cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
+  cairo_set_line_cap(cr, CAIRO_LINE_CAP_SQUARE);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+    render_grid(cr, atlas, &info);
+    cairo_surface_flush(surface);
+    frames++;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ns = elapsed_ns(&start, &end);
+  } while (frames < MIN_FRAMES || ns < MIN_NS);
+
+  for (i = 0; i < nclip_rectangles; i++) {
+    if (clip_rectangles[i].width > 0 && clip_rectangles[i].height > 0)
+      nrects++;
+  }
+
+  printf("size=%-5s grid=%2dx%-2d %9.1f us/frame  rects=%-4d bytes=%lld\n",
+         name, grid, grid, ns / frames / 1000, nrects,
+         bytes_touched(&info, atlas));
+
+  cairo_destroy(cr);
+  cairo_surface_destroy(surface);
+}
+
+int main(int argc, char **argv) {
+  label_atlas_t atlas;
+  int i, grid;
+
+  memset(&atlas, 0, sizeof(label_atlas_t));
+  label_atlas_measure(&atlas);
+  atlas.surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+                                             atlas.width, atlas.height);
+  label_atlas_paint(&atlas);
+
+  for (i = 0; i < NSIZES; i++) {
+    for (grid = GRID_MIN; grid <= GRID_MAX; grid++) {
+      bench(sizes[i].name, sizes[i].w, sizes[i].h, grid, &atlas);
+    }
+  }
+
+  cairo_surface_destroy(atlas.surface);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,99 @@
+/*
+ * Benchmark: setting the window shape from rectangles versus a bitmap.
+ *
+ * Renders labelled grids from 26x26 up to 100x100 at 1080p, 4K and 8K and
+ * sets the keynav window's shape from the resulting clip rectangles, once
+ * as a rectangle list and once through the shape bitmap. Each shape is
+ * followed by a round trip so the server's work is included. Needs an X
+ * server with the SHAPE extension; Xvfb will do.
+ */
+
+#define KEYNAV_NO_MAIN
+#include "../keynav.c"
+
+#define ROUNDS (20)
+
+static const struct { const char *name; int w; int h; } sizes[] = {
+  { "1080p", 1920, 1080 },
+  { "4k", 3840, 2160 },
+  { "8k", 7680, 4320 },
+};
+#define NSIZES (sizeof(sizes) / sizeof(*sizes))
+
+static const int grids[] = { 26, 50, 75, 100 };
+#define NGRIDS (sizeof(grids) / sizeof(*grids))
+
+/* Time a full shape with the given threshold, in microseconds per shape */
+static double bench_path(overlay_t *ov, int threshold) {
+  long long start_us;
+  int i;
+
+  shape_mask_threshold = threshold;
+  start_us = now_us();
+  for (i = 0; i < ROUNDS; i++) {
+    ov->shape_valid = 0;
+    shape_apply(ov, clip_rectangles, nclip_rectangles);
+    XSync(dpy, False);
+  }
+  return (double)(now_us() - start_us) / ROUNDS;
+}
+
+static void bench(const char *name, int w, int h, int grid) {
+  Screen *screen = DefaultScreenOfDisplay(dpy);
+  viewport_t viewport;
+  overlay_t *ov;
+  int nrects = 0;
+  int i;
+
+  memset(&viewport, 0, sizeof(viewport_t));
+  viewport.w = w;
+  viewport.h = h;
+  viewport.screen_num = DefaultScreen(dpy);
+  viewport.screen = screen;
+  viewport.root = RootWindowOfScreen(screen);
+  ov = overlay_new(&viewport);
+
+  memset(&wininfo, 0, sizeof(wininfo_t));
+  wininfo.w = w;
+  wininfo.h = h;
+  wininfo.grid_rows = grid;
+  wininfo.grid_cols = grid;
+  wininfo.border_thickness = 3;
+  render_grid(ov->canvas_cairo, label_atlas_get(ov->screen_num), &wininfo);
+  for (i = 0; i < nclip_rectangles; i++) {
+    if (clip_rectangles[i].width > 0 && clip_rectangles[i].height > 0)
+      nrects++;
+  }
+
+  printf("size=%-5s grid=%3dx%-3d rects=%-5d rectangles: %8.1f us  "
+         "bitmap: %8.1f us\n", name, grid, grid, nrects,
+         bench_path(ov, INT_MAX), bench_path(ov, 0));
+  overlay_free(ov);
+}
+
+int main(int argc, char **argv) {
+  char *display_name = getenv("DISPLAY");
+  int event_base, error_base;
+  int i, j;
+
+  if (display_name == NULL || (dpy = XOpenDisplay(display_name)) == NULL) {
+    fprintf(stderr, "Can't open display; run this under Xvfb\n");
+    return EXIT_FAILURE;
+  }
+  if (!XShapeQueryExtension(dpy, &event_base, &error_base)) {
+    fprintf(stderr, "The X server has no SHAPE extension\n");
+    return EXIT_FAILURE;
+  }
+  xdo = xdo_new_with_opened_display(dpy, display_name, False);
+  argb_overlay = 0; /* the shape is what is being measured */
+  appstate.grid_label = GRID_LABEL_AA;
+
+  for (i = 0; i < NSIZES; i++) {
+    for (j = 0; j < NGRIDS; j++) {
+      bench(sizes[i].name, sizes[i].w, sizes[i].h, grids[j]);
+    }
+  }
+
+  xdo_free(xdo);
+  return EXIT_SUCCESS;
+}
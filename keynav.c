@@ -5,29 +5,41 @@
  *      same as wininfo, so use that instead.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* asprintf, and struct ucred on Linux */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <ctype.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <X11/Xlib.h>
+#include <X11/Xlib-xcb.h>
 #include <X11/XKBlib.h>
 #include <X11/Xresource.h>
 #include <X11/Xutil.h>
 #include <X11/keysym.h>
 #include <X11/extensions/shape.h>
+#include <X11/extensions/XTest.h>
+#include <X11/extensions/Xfixes.h>
 #include <X11/extensions/Xinerama.h>
 #include <X11/extensions/Xrandr.h>
 #include <glib.h>
 #include <cairo-xlib.h>
-
-#ifdef PROFILE_THINGS
 #include <time.h>
-#endif
 
 #include <xdo.h>
 #include "keynav_version.h"
@@ -47,24 +59,27 @@ struct appstate {
   int dragging;
   int need_draw;
   int need_moveresize;
+  int need_frame; /* wininfo changed since the last frame_commit */
   enum { record_getkey, record_ing, record_off } recording;
   int playback;
 
   int grid_nav; /* 1 if grid nav is active */
-  enum { GRID_NAV_COL, GRID_NAV_ROW } grid_nav_state;
   enum { GRID_LABEL_NONE, GRID_LABEL_AA } grid_label;
-  int grid_nav_col;
-  int grid_nav_row;
+  int grid_nav_node; /* label trie node typed so far, 0 for none */
+  int grid_nav_rows; /* the grid grid_nav_node belongs to */
+  int grid_nav_cols;
 };
 
 typedef enum { HANDLE_CONTINUE, HANDLE_STOP } handler_info_t;
 
 typedef struct recording {
   int keycode;
-  GPtrArray *commands;
+  int mods;
+  GPtrArray *commands; /* command strings, one per recorded command */
+  struct program *program; /* all of them compiled, for playback */
 } recording_t;
 
-GPtrArray *recordings;
+GHashTable *recordings; /* recording_t by KEYBINDING_KEY(keycode, mods) */
 recording_t *active_recording = NULL;
 char *recordings_filename = NULL;
 
@@ -85,6 +100,60 @@ typedef struct mouseinfo {
   int y;
 } mouseinfo_t;
 
+/* Rendered frames are cached by everything that affects what gets drawn,
+ * so revisiting a geometry costs a copy and a shape request. */
+typedef struct frame_key {
+  int w;
+  int h;
+  int grid_rows;
+  int grid_cols;
+  int border_thickness;
+  int grid_label;
+  int label_prefix; /* grid-nav label trie node typed so far, or 0 */
+} frame_key_t;
+
+typedef struct frame {
+  frame_key_t key;
+  Pixmap pixmap;
+  XRectangle *rectangles;
+  int nrectangles;
+  unsigned long last_used;
+  int speculative; /* drawn ahead of time and not shown yet */
+} frame_t;
+
+/* The keynav window and everything we draw it with. */
+typedef struct overlay {
+  Window zone;
+  int depth;
+  int screen_num;
+  GC canvas_gc;
+  Pixmap canvas;
+  Pixmap front; /* what the window currently shows, for Expose */
+  frame_t *frames;
+  int nframes;
+  XRectangle *shape_rects; /* last shape sent, sorted, for shape_apply */
+  int nshape_rects;
+  int shape_valid;
+  XRectangle shape_touched; /* pixels changed by open/closepixel since */
+  wininfo_t shown; /* geometry as of the last frame_commit */
+  int mapped;
+  cairo_surface_t *canvas_surface;
+  cairo_t *canvas_cairo;
+  Pixmap shape;
+  cairo_surface_t *shape_surface;
+  cairo_t *shape_cairo;
+  int shape_mask_w, shape_mask_h; /* extent of what may be set in shape */
+  int argb; /* 32-bit window under a compositor; the canvas alpha is the
+               shape, and input passes through everywhere */
+  Colormap colormap; /* for the ARGB visual, or None */
+  int persistent; /* owned by a viewport and reused across activations */
+} overlay_t;
+
+enum {
+  VIEWPORT_LEFT, VIEWPORT_RIGHT, VIEWPORT_UP, VIEWPORT_DOWN,
+  VIEWPORT_NDIRECTIONS
+};
+
 typedef struct viewport {
   int x;
   int y;
@@ -93,29 +162,34 @@ typedef struct viewport {
   int screen_num;
   Screen *screen;
   Window root;
+  overlay_t *overlay; /* prebuilt overlay, in persistent-overlay mode */
+  int neighbor[VIEWPORT_NDIRECTIONS]; /* nearest viewport each way, or -1 */
 } viewport_t;
 
 static wininfo_t wininfo;
 static mouseinfo_t mouseinfo;
 static viewport_t *viewports;
 static int nviewports = 0;
-static int xinerama = 0;
+
+/* Where the pointer was for the key press being handled, so 'start' can
+ * find the current screen without asking the X server */
+static struct {
+  int valid;
+  Window root;
+  int x;
+  int y;
+} keypress_pointer;
+static int xinerama = 0; /* viewports share one root (Xinerama or RandR) */
+static int screens_changed = 0; /* RandR reported a new configuration */
 static int daemonize = 0;
 static int is_daemon = False;
 
 static Display *dpy;
-static Window zone;
+static xcb_connection_t *xcb; /* dpy's connection, for checked requests */
+static overlay_t *overlay = NULL; /* the overlay in use while active */
 XRectangle *clip_rectangles = NULL;
 int nclip_rectangles = 0;
 
-static GC canvas_gc;
-static Pixmap canvas;
-static cairo_surface_t *canvas_surface;
-static cairo_t *canvas_cairo;
-static Pixmap shape;
-static cairo_surface_t *shape_surface;
-static cairo_t *shape_cairo;
-
 static xdo_t *xdo;
 static struct appstate appstate = {
   .active = 0,
@@ -127,127 +201,425 @@ static struct appstate appstate = {
 static int drag_button = 0;
 static char drag_modkeys[128];
 
+/* Settings changed with the 'set' command */
+static int persistent_overlay = 0;
+static int frame_cache_size = 8;
+
+static char *label_font = NULL; /* NULL means LABEL_FONT_DEFAULT */
+static char *label_alphabet = NULL; /* NULL means LABEL_ALPHABET_DEFAULT */
+static char *label_style = NULL; /* "rowcol" (NULL) or "hint" */
+static int label_font_size = 18;
+static char *speculate_keys = NULL;
+static int gnome_moveresize_sync = 0;
+static int playback_animate = 0;
+static int shape_mask_threshold = 512;
+static int argb_overlay = 1;
+static char *input_backend = NULL; /* "xtest", "xdo" or NULL for the best */
+static int input_delay = 0;
+static int history_depth; /* defined with the history ring below */
+
+typedef struct option {
+  char *name;
+  enum { OPTION_BOOL, OPTION_INT, OPTION_STRING } type;
+  void *value; /* int * or char ** depending on type */
+  void (*changed)();
+} option_t;
+
+void overlays_prepare();
+void overlays_rebuild();
+void frame_caches_clear();
+void label_atlases_invalidate();
+void labels_changed();
+void speculate_keys_changed();
+void history_depth_changed();
+void input_backend_changed();
+
+option_t options[] = {
+  "persistent-overlay", OPTION_BOOL, &persistent_overlay, overlays_prepare,
+  "frame-cache", OPTION_INT, &frame_cache_size, frame_caches_clear,
+  "label-font", OPTION_STRING, &label_font, label_atlases_invalidate,
+  "label-font-size", OPTION_INT, &label_font_size, label_atlases_invalidate,
+  "label-alphabet", OPTION_STRING, &label_alphabet, labels_changed,
+  "label-style", OPTION_STRING, &label_style, labels_changed,
+  "speculate", OPTION_STRING, &speculate_keys, speculate_keys_changed,
+  "gnome-moveresize-sync", OPTION_BOOL, &gnome_moveresize_sync, NULL,
+  "history-depth", OPTION_INT, &history_depth, history_depth_changed,
+  "playback-animate", OPTION_BOOL, &playback_animate, NULL,
+  "shape-mask-threshold", OPTION_INT, &shape_mask_threshold, NULL,
+  "argb-overlay", OPTION_BOOL, &argb_overlay, overlays_rebuild,
+  "input-backend", OPTION_STRING, &input_backend, input_backend_changed,
+  "input-delay", OPTION_INT, &input_delay, NULL,
+  NULL, 0, NULL, NULL,
+};
+
+/* Grid-nav labels are strings over the label alphabet, one per cell. They
+ * are prefix-free, so together they form a trie: each typed key moves one
+ * node down, and reaching a leaf selects its cell. The 'rowcol' style
+ * spells the row and then the column in fixed-width digits of the
+ * alphabet, which gives the classic "AA" labels for grids up to 26x26.
+ * The 'hint' style gives each cell the shortest label it can, so small
+ * grids need a single key. */
+#define LABEL_ALPHABET_DEFAULT "abcdefghijklmnopqrstuvwxyz"
+#define LABEL_MAX_LENGTH (8)
+
+typedef struct label_node {
+  int parent;
+  int symbol;   /* alphabet index typed to get here from the parent */
+  int depth;
+  int children; /* index of the first of nsymbols consecutive children,
+                   or -1 */
+  int cell;     /* row * grid_cols + col if this completes a label, or -1 */
+} label_node_t;
+
+typedef struct grid_labels {
+  int generation; /* label_generation these were built for */
+  int rows;
+  int cols;
+  int nsymbols;
+  label_node_t *nodes; /* nodes[0] is the root */
+  int nnodes;
+  int *leaves;         /* cell -> node completing its label, or -1 */
+} grid_labels_t;
+
+static grid_labels_t grid_labels;
+static int label_generation = 0;
+static int label_keys[256]; /* keycode -> alphabet index, or -1 */
+static int label_keys_generation = -1;
+
+/* Each letter of the alphabet, plain and highlighted, is drawn once per
+ * screen into an atlas; labels are a box plus letter tiles copied out of
+ * it. */
+#define LABEL_FONT_DEFAULT "Courier"
+#define LABEL_PAD_X (12) /* label box padding around the letters */
+#define LABEL_PAD_Y (3)
+
+typedef struct label_atlas {
+  Pixmap pixmap;
+  cairo_surface_t *surface;
+  int generation; /* label_atlas_generation when this was drawn */
+  int width;      /* surface size: one tile per letter, two rows */
+  int height;
+  int glyph_w;    /* one letter tile */
+  int glyph_h;
+  int rectheight; /* label box height; the width depends on the label */
+} label_atlas_t;
+
+static label_atlas_t *label_atlases = NULL; /* one per X screen */
+static int label_atlas_generation = 0;
+
+/* Latency tracking, reported by the 'stats' command. Each timing keeps a
+ * histogram with power-of-two microsecond buckets: bucket i counts samples
+ * below 2^i us, so recording a sample is a few integer ops. */
+#define TIMING_BUCKETS 32
+typedef struct timing {
+  char *name;
+  unsigned long count;
+  long long total_us;
+  long long min_us;
+  long long max_us;
+  unsigned long buckets[TIMING_BUCKETS];
+} timing_t;
+
+enum {
+  TIMING_KEYPRESS_TO_FRAME,
+  TIMING_START_TO_FRAME,
+  TIMING_START,
+  TIMING_GRAB_WAIT,
+  TIMING_CONFIG_LOAD,
+  TIMING_RENDER,
+  TIMING_SHAPE,
+  TIMING_WARP,
+  NTIMINGS
+};
+
+static timing_t timings[NTIMINGS] = {
+  { "keypress-to-frame" },
+  { "start-to-first-frame" },
+  { "start" },
+  { "keyboard-grab-wait" },
+  { "config-load" },
+  { "render" },
+  { "shape" },
+  { "warp" },
+};
+
+static long long start_time_us = 0; /* when the pending 'start' began */
+static long long keypress_time_us = 0; /* first key not yet shown in a frame */
+
+/* Another client may hold the keyboard when 'start' runs (see
+ * grab_keyboard). Rather than sleeping, we wait for events that hint the
+ * grab was released and retry then, with a short poll in case no such
+ * event comes. Commands from a 'start' onwards are queued until the grab
+ * succeeds or grab_deadline_us passes. */
+#define GRAB_TIMEOUT_US 1000000
+#define GRAB_POLL_US 20000
+static int grab_pending = 0;
+static long long grab_wait_start_us = 0;
+static long long grab_deadline_us = 0;
+static GQueue *grab_queue = NULL; /* command strings to run once grabbed */
+static int xkb_event_base = -1;
+
+static unsigned long frame_cache_hits = 0;
+static unsigned long frame_cache_misses = 0;
+
+/* Keys whose bindings are drawn ahead of time while waiting for input */
+typedef struct speculation {
+  int keycode;
+  int mods;
+} speculation_t;
+
+static speculation_t *speculations = NULL;
+static int nspeculations = 0;
+static int speculate_next = -1; /* next candidate to draw, -1 when idle */
+
+static unsigned long speculations_drawn = 0;
+static unsigned long speculations_used = 0;
+
+static unsigned long shape_sets = 0;
+static unsigned long shape_masks = 0;
+static unsigned long shape_diffs = 0;
+static unsigned long shape_offsets = 0;
+static unsigned long shape_unchanged = 0;
+
+/* Command arguments, parsed once when a command string is compiled. Which
+ * fields are meaningful depends on the command; see the parse_arg_* functions.
+ */
+typedef struct cmdarg {
+  char *str;    /* string argument with surrounding quotes removed */
+  int count;    /* how many numeric values were given */
+  float value;  /* cut and move value */
+  int num[2];   /* grid size, cell, zoom size, mouse button, grid-nav mode */
+} cmdarg_t;
+
+enum { GRID_NAV_KEEP, GRID_NAV_ON, GRID_NAV_OFF, GRID_NAV_TOGGLE };
+
 /* history tracking */
-#define WININFO_MAXHIST (100)
-static wininfo_t wininfo_history[WININFO_MAXHIST]; /* XXX: is 100 enough? */
-static int wininfo_history_cursor = 0;
+/* History is a ring buffer of 'history-depth' entries. Positions count up
+ * forever and index the ring modulo its depth: history_first is the oldest
+ * entry kept, history_cursor the one wininfo was last saved to or restored
+ * from, and entries up to history_end are there for history-forward. */
+#define HISTORY_DEPTH_DEFAULT (100)
+static wininfo_t *wininfo_history = NULL;
+static int history_depth = HISTORY_DEPTH_DEFAULT;
+static int history_ring_size = 0; /* entries allocated in wininfo_history */
+static unsigned long history_first = 0;
+static unsigned long history_cursor = 0;
+static unsigned long history_end = 0;
 
 void defaults();
-
-void cmd_cell_select(char *args);
-void cmd_click(char *args);
-void cmd_cursorzoom(char *args);
-void cmd_cut_down(char *args);
-void cmd_cut_left(char *args);
-void cmd_cut_right(char *args);
-void cmd_cut_up(char *args);
-void cmd_daemonize(char *args);
-void cmd_doubleclick(char *args);
-void cmd_drag(char *args);
-void cmd_end(char *args);
-void cmd_toggle_start(char *args);
-void cmd_grid(char *args);
-void cmd_grid_nav(char *args);
-void cmd_history_back(char *args);
-void cmd_loadconfig(char *args);
-void cmd_move_down(char *args);
-void cmd_move_left(char *args);
-void cmd_move_right(char *args);
-void cmd_move_up(char *args);
-void cmd_quit(char *args);
-void cmd_record(char *args);
-void cmd_playback(char *args);
-void cmd_restart(char *args);
-void cmd_shell(char *args);
-void cmd_start(char *args);
-void cmd_warp(char *args);
-void cmd_windowzoom(char *args);
+void config_clear();
+void config_cache_add_file(const char *path);
+void config_cache_error();
+char *config_cache_path();
+uint32_t config_cache_key();
+int config_cache_replay(const char *path, uint32_t cache_key);
+void config_cache_record_start();
+void config_cache_record_finish(const char *path, uint32_t cache_key);
+
+void cmd_cell_select(const cmdarg_t *arg);
+void cmd_click(const cmdarg_t *arg);
+void cmd_cursorzoom(const cmdarg_t *arg);
+void cmd_cut_down(const cmdarg_t *arg);
+void cmd_cut_left(const cmdarg_t *arg);
+void cmd_cut_right(const cmdarg_t *arg);
+void cmd_cut_up(const cmdarg_t *arg);
+void cmd_daemonize(const cmdarg_t *arg);
+void cmd_doubleclick(const cmdarg_t *arg);
+void cmd_drag(const cmdarg_t *arg);
+void cmd_end(const cmdarg_t *arg);
+void cmd_toggle_start(const cmdarg_t *arg);
+void cmd_grid(const cmdarg_t *arg);
+void cmd_grid_nav(const cmdarg_t *arg);
+void cmd_history_back(const cmdarg_t *arg);
+void cmd_history_forward(const cmdarg_t *arg);
+void cmd_loadconfig(const cmdarg_t *arg);
+void cmd_move_down(const cmdarg_t *arg);
+void cmd_move_left(const cmdarg_t *arg);
+void cmd_move_right(const cmdarg_t *arg);
+void cmd_move_up(const cmdarg_t *arg);
+void cmd_quit(const cmdarg_t *arg);
+void cmd_record(const cmdarg_t *arg);
+void cmd_playback(const cmdarg_t *arg);
+void cmd_restart(const cmdarg_t *arg);
+void cmd_set(const cmdarg_t *arg);
+void cmd_shell(const cmdarg_t *arg);
+void cmd_start(const cmdarg_t *arg);
+void cmd_stats(const cmdarg_t *arg);
+void cmd_warp(const cmdarg_t *arg);
+void cmd_windowzoom(const cmdarg_t *arg);
 
 void update();
+void frame_commit();
 void correct_overflow();
 void handle_keypress(XKeyEvent *e);
-void handle_commands(char *commands);
+int handle_commands(char *commands);
 void parse_config();
 int parse_config_line(char *line);
 void save_history_point();
 void restore_history_point(int moves_ago);
+void history_clear();
+void history_depth_changed();
 void cell_select(int x, int y);
 handler_info_t handle_recording(XKeyEvent *e);
 handler_info_t handle_gridnav(XKeyEvent *e);
 
 void query_screens();
-void query_screen_xinerama();
-void query_screen_normal();
+int query_screen_randr(viewport_t **table);
+int query_screen_xinerama(viewport_t **table);
+int query_screen_normal(viewport_t **table);
 int viewport_sort(const void *a, const void *b);
 int query_current_screen();
-int query_current_screen_xinerama();
-int query_current_screen_normal();
-void viewport_left();
-void viewport_right();
+void viewports_link();
+int viewport_at(Window root, int x, int y);
+void viewport_move(int direction);
 int pointinrect(int px, int py, int rx, int ry, int rw, int rh);
-int percent_of(int num, char *args, float default_val);
+int percent_of(int num, const cmdarg_t *arg, float default_val);
 void sigchld(int sig);
 void sighup(int sig);
 void restart();
-void recordings_save(const char *filename);
-void parse_recordings(const char *filename);
+void recordings_append(const char *filename, const recording_t *rec);
+void recordings_load(const char *filename);
+void recording_free(gpointer data);
+void recording_store(recording_t *rec);
+void playback_run(const recording_t *rec);
 void openpixel(Display *dpy, Window zone, mouseinfo_t *mouseinfo);
 void closepixel(Display *dpy, Window zone, mouseinfo_t *mouseinfo);
+overlay_t *overlay_new(viewport_t *viewport);
+int overlay_wants_argb(const viewport_t *viewport, XVisualInfo *vinfo);
+void overlay_render(overlay_t *ov, wininfo_t *info);
+void overlay_free(overlay_t *ov);
+void overlays_free();
+Pixmap draw_frame(const XRectangle **rects, int *nrects);
+void frame_key_init(frame_key_t *key, const wininfo_t *info);
+frame_t *frame_cache_lookup(overlay_t *ov, const frame_key_t *key);
+frame_t *frame_cache_store(overlay_t *ov, const frame_key_t *key);
+void frame_cache_clear(overlay_t *ov);
+label_atlas_t *label_atlas_get(int screen_num);
+void label_atlas_measure(label_atlas_t *atlas);
+const char *label_alphabet_get();
+grid_labels_t *grid_labels_get(int rows, int cols);
+int label_child(const grid_labels_t *labels, int node, int symbol);
+int grid_nav_prefix(const wininfo_t *info);
+void label_atlas_paint(label_atlas_t *atlas);
+void render_grid(cairo_t *cr, label_atlas_t *atlas, wininfo_t *info);
+void updategrid(cairo_t *cr, struct wininfo *info, XRectangle *rects);
+void updategridtext(cairo_t *cr, label_atlas_t *atlas, struct wininfo *info,
+                    XRectangle *rects);
+void shape_apply(overlay_t *ov, const XRectangle *rects, int nrects);
+void shape_touch(overlay_t *ov, const XRectangle *rect);
+void shape_mask_apply(overlay_t *ov, const XRectangle *rects, int nrects);
+long long now_us();
+void timing_record(int which, long long start_us);
+int speculate();
+
+int parse_arg_none(const char *args, cmdarg_t *arg);
+int parse_arg_value(const char *args, cmdarg_t *arg);
+int parse_arg_size(const char *args, cmdarg_t *arg);
+int parse_arg_grid(const char *args, cmdarg_t *arg);
+int parse_arg_grid_nav(const char *args, cmdarg_t *arg);
+int parse_arg_cell(const char *args, cmdarg_t *arg);
+int parse_arg_button(const char *args, cmdarg_t *arg);
+int parse_arg_drag(const char *args, cmdarg_t *arg);
+int parse_arg_string(const char *args, cmdarg_t *arg);
+int parse_arg_set(const char *args, cmdarg_t *arg);
+
+/* Command flags */
+#define CMD_GEOMETRY (1 << 0) /* only changes wininfo, no other effects */
+#define CMD_FLUSH (1 << 1) /* acts on what's on screen; draw pending changes */
 
 typedef struct dispatch {
   char *command;
-  void (*func)(char *args);
+  void (*func)(const cmdarg_t *arg);
+  int (*parse)(const char *args, cmdarg_t *arg);
+  int flags;
 } dispatch_t;
 
 dispatch_t dispatch[] = {
-  "cut-up", cmd_cut_up,
-  "cut-down", cmd_cut_down,
-  "cut-left", cmd_cut_left,
-  "cut-right", cmd_cut_right,
-  "move-up", cmd_move_up,
-  "move-down", cmd_move_down,
-  "move-left", cmd_move_left,
-  "move-right", cmd_move_right,
-  "cursorzoom", cmd_cursorzoom,
-  "windowzoom", cmd_windowzoom,
+  "cut-up", cmd_cut_up, parse_arg_value, CMD_GEOMETRY,
+  "cut-down", cmd_cut_down, parse_arg_value, CMD_GEOMETRY,
+  "cut-left", cmd_cut_left, parse_arg_value, CMD_GEOMETRY,
+  "cut-right", cmd_cut_right, parse_arg_value, CMD_GEOMETRY,
+  "move-up", cmd_move_up, parse_arg_value, CMD_GEOMETRY,
+  "move-down", cmd_move_down, parse_arg_value, CMD_GEOMETRY,
+  "move-left", cmd_move_left, parse_arg_value, CMD_GEOMETRY,
+  "move-right", cmd_move_right, parse_arg_value, CMD_GEOMETRY,
+  "cursorzoom", cmd_cursorzoom, parse_arg_size, 0,
+  "windowzoom", cmd_windowzoom, parse_arg_none, 0,
 
   // Grid commands
-  "grid", cmd_grid,
-  "grid-nav", cmd_grid_nav,
-  "cell-select", cmd_cell_select,
+  "grid", cmd_grid, parse_arg_grid, CMD_GEOMETRY,
+  "grid-nav", cmd_grid_nav, parse_arg_grid_nav, 0,
+  "cell-select", cmd_cell_select, parse_arg_cell, CMD_GEOMETRY,
 
   // Mouse activity
-  "warp", cmd_warp,
-  "click", cmd_click,
-  "doubleclick", cmd_doubleclick,
-  "drag", cmd_drag,
+  "warp", cmd_warp, parse_arg_none, CMD_FLUSH,
+  "click", cmd_click, parse_arg_button, CMD_FLUSH,
+  "doubleclick", cmd_doubleclick, parse_arg_button, CMD_FLUSH,
+  "drag", cmd_drag, parse_arg_drag, CMD_FLUSH,
 
   // Other commands.
-  "loadconfig", cmd_loadconfig,
-  "daemonize", cmd_daemonize,
-  "sh", cmd_shell,
-  "start", cmd_start,
-  "end", cmd_end,
-  "toggle-start", cmd_toggle_start,
-  "history-back", cmd_history_back,
-  "quit", cmd_quit,
-  "restart", cmd_restart,
-  "record", cmd_record,
-  "playback", cmd_playback,
-  NULL, NULL,
+  "loadconfig", cmd_loadconfig, parse_arg_string, 0,
+  "daemonize", cmd_daemonize, parse_arg_none, 0,
+  "sh", cmd_shell, parse_arg_string, CMD_FLUSH,
+  "start", cmd_start, parse_arg_none, 0,
+  "end", cmd_end, parse_arg_none, 0,
+  "toggle-start", cmd_toggle_start, parse_arg_none, 0,
+  "history-back", cmd_history_back, parse_arg_none, 0,
+  "history-forward", cmd_history_forward, parse_arg_none, 0,
+  "quit", cmd_quit, parse_arg_none, 0,
+  "restart", cmd_restart, parse_arg_none, 0,
+  "record", cmd_record, parse_arg_string, 0,
+  "playback", cmd_playback, parse_arg_none, 0,
+  "set", cmd_set, parse_arg_set, 0,
+  "stats", cmd_stats, parse_arg_string, 0,
+  NULL, NULL, NULL, 0,
 };
 
+/* A command string like "cut-left,warp,click 1" compiled into resolved
+ * handlers with parsed arguments, so running it needs no string work. */
+typedef struct command {
+  const dispatch_t *dispatch;
+  char *text; /* the command as written, escapes and quotes included, so
+                 joining texts with ',' gives back the same program */
+  cmdarg_t arg;
+} command_t;
+
+/* Programs are reference counted: a running program holds a reference,
+ * so a 'loadconfig' or 'clear' in it that drops its binding doesn't free
+ * the commands still being run. */
+typedef struct program {
+  command_t *commands;
+  int ncommands;
+  int refs;
+} program_t;
+
+program_t *program_compile(const char *commands);
+void program_free(program_t *program);
+void program_run(program_t *program);
+void program_queue_rest(const program_t *program, int first);
+void addbinding_program(int keycode, int mods, const char *commands,
+                        program_t *program);
+
 typedef struct keybinding {
   char *commands;
+  program_t *program;
   int keycode;
   int mods;
 } keybinding_t;
 
-GPtrArray *keybindings = NULL;
+/* Keybindings are indexed by (keycode, modifier state) so a keypress costs
+ * one hash lookup regardless of how many bindings are configured. The state
+ * used here is already masked as in handle_keypress, so it fits above the
+ * 8-bit keycode. */
+#define KEYBINDING_KEY(keycode, mods) \
+  GUINT_TO_POINTER(((unsigned int)(mods) << 8) | ((keycode) & 0xff))
+
+GHashTable *keybindings = NULL;
 
 typedef struct startkey {
   int keycode;
   int mods;
+  char *keyseq; /* for error messages */
 } startkey_t;
 
 GPtrArray *startkeys = NULL;
@@ -347,49 +719,171 @@ int parse_mods(char *keyseq) {
   return modmask;
 }
 
-void addbinding(int keycode, int mods, char *commands) {
+void keybinding_free(gpointer data) {
+  keybinding_t *keybinding = data;
+  free(keybinding->commands);
+  program_free(keybinding->program);
+  free(keybinding);
+}
+
+keybinding_t *keybinding_lookup(int keycode, int mods) {
+  return g_hash_table_lookup(keybindings, KEYBINDING_KEY(keycode, mods));
+}
+
+/* Start keys are grabbed (and ungrabbed) through XCB with checked requests.
+ * The requests are only queued here; grab_checks_collect sends them all and
+ * waits for the replies in one pass, so loading a config costs one round
+ * trip, and a key another program already grabbed is reported by name. */
+typedef struct grab_check {
+  xcb_void_cookie_t cookie;
+  char *keyseq;
+  int grab; /* 1 for a grab, 0 for an ungrab */
+} grab_check_t;
+
+static GPtrArray *grab_checks = NULL;
+
+/* Describe keycode+mods the way keynavrc spells it, for error messages */
+char *keyseq_describe(int keycode, int mods) {
+  static const struct { int mask; const char *name; } modnames[] = {
+    { ControlMask, "ctrl" }, { Mod1Mask, "alt" }, { Mod4Mask, "super" },
+    { ShiftMask, "shift" }, { Mod3Mask, "mod3" }, { Mod5Mask, "mod5" },
+  };
+  GString *keyseq = g_string_new(NULL);
+  KeySym sym = XkbKeycodeToKeysym(dpy, keycode, 0, 0);
+  const char *symname = XKeysymToString(sym);
   int i;
 
-  // Check if we already have a binding for this, if so, override it.
-  for (i = 0; i < keybindings->len; i++) {
-    keybinding_t *kbt = g_ptr_array_index(keybindings, i);
-    if (kbt->keycode == keycode && kbt->mods == mods) {
-      free(kbt->commands);
-      kbt->commands = strdup(commands);
-      return;
+  for (i = 0; i < sizeof(modnames) / sizeof(*modnames); i++) {
+    if (mods & modnames[i].mask)
+      g_string_append_printf(keyseq, "%s+", modnames[i].name);
+  }
+  if (symname != NULL)
+    g_string_append(keyseq, symname);
+  else
+    g_string_append_printf(keyseq, "keycode %d", keycode);
+  return g_string_free(keyseq, FALSE);
+}
+
+/* Queue a grab or ungrab of a start key, with and without Lock and NumLock,
+ * on every screen */
+void grab_startkey(const startkey_t *startkey, int grab) {
+  static const int variants[] = { 0, LockMask, Mod2Mask, LockMask | Mod2Mask };
+  int i, j;
+
+  if (grab_checks == NULL)
+    grab_checks = g_ptr_array_new();
+
+  for (i = 0; i < ScreenCount(dpy); i++) {
+    Window root = RootWindow(dpy, i);
+    for (j = 0; j < sizeof(variants) / sizeof(*variants); j++) {
+      grab_check_t *check = calloc(1, sizeof(grab_check_t));
+      int mods = startkey->mods | variants[j];
+
+      if (grab) {
+        check->cookie = xcb_grab_key_checked(xcb, False, root, mods,
+                                             startkey->keycode,
+                                             XCB_GRAB_MODE_ASYNC,
+                                             XCB_GRAB_MODE_ASYNC);
+      } else {
+        check->cookie = xcb_ungrab_key_checked(xcb, startkey->keycode, root,
+                                               mods);
+      }
+      check->keyseq = startkey->keyseq;
+      check->grab = grab;
+      g_ptr_array_add(grab_checks, check);
+    }
+  }
+}
+
+/* Wait for every queued grab and ungrab, reporting each key sequence that
+ * failed once. Returns the number of key sequences that failed. */
+int grab_checks_collect() {
+  const char *last_failed = NULL;
+  int failures = 0;
+  int i;
+
+  if (grab_checks == NULL)
+    return 0;
+
+  for (i = 0; i < grab_checks->len; i++) {
+    grab_check_t *check = g_ptr_array_index(grab_checks, i);
+    xcb_generic_error_t *error = xcb_request_check(xcb, check->cookie);
+
+    if (error != NULL) {
+      if (last_failed != check->keyseq) {
+        if (check->grab && error->error_code == BadAccess) {
+          fprintf(stderr, "Failed to grab key '%s': "
+                  "another program already grabbed it\n", check->keyseq);
+        } else {
+          fprintf(stderr, "Failed to %s key '%s' (X error %d)\n",
+                  check->grab ? "grab" : "ungrab", check->keyseq,
+                  error->error_code);
+        }
+        failures++;
+        last_failed = check->keyseq;
+      }
+      free(error);
     }
+    free(check);
+  }
+  g_ptr_array_set_size(grab_checks, 0);
+  return failures;
+}
+
+void startkey_free(startkey_t *startkey) {
+  free(startkey->keyseq);
+  free(startkey);
+}
+
+int addbinding(int keycode, int mods, char *commands) {
+  program_t *program = NULL;
+
+  /* Compile now so bad commands are reported at load, not on keypress */
+  program = program_compile(commands);
+  if (program == NULL) {
+    return 1;
   }
+  addbinding_program(keycode, mods, commands, program);
+  return 0;
+}
 
+/* Bind an already compiled program; the binding takes it over */
+void addbinding_program(int keycode, int mods, const char *commands,
+                        program_t *program) {
   keybinding_t *keybinding = NULL;
+
+  // Check if we already have a binding for this, if so, override it.
+  keybinding = keybinding_lookup(keycode, mods);
+  if (keybinding != NULL) {
+    free(keybinding->commands);
+    program_free(keybinding->program);
+    keybinding->commands = strdup(commands);
+    keybinding->program = program;
+    return;
+  }
+
   keybinding = calloc(sizeof(keybinding_t), 1);
   keybinding->commands = strdup(commands);
+  keybinding->program = program;
   keybinding->keycode = keycode;
   keybinding->mods = mods;
-  g_ptr_array_add(keybindings, keybinding);
+  g_hash_table_insert(keybindings, KEYBINDING_KEY(keycode, mods), keybinding);
 
-  if (!strncmp(commands, "start", 5) || !strncmp(commands, "toggle-start", 12)) {
-    int i = 0;
+  void (*first)(const cmdarg_t *) = program->commands[0].dispatch->func;
+  if (first == cmd_start || first == cmd_toggle_start) {
     startkey_t *startkey = calloc(sizeof(startkey_t), 1);
     startkey->keycode = keycode;
     startkey->mods = mods;
+    startkey->keyseq = keyseq_describe(keycode, mods);
     g_ptr_array_add(startkeys, startkey);
     /* Grab on all screen root windows */
-    for (i = 0; i < ScreenCount(dpy); i++) {
-      Window root = RootWindow(dpy, i);
-      XGrabKey(dpy, keycode, mods, root, False, GrabModeAsync, GrabModeAsync);
-      XGrabKey(dpy, keycode, mods | LockMask, root, False, GrabModeAsync, GrabModeAsync);
-      XGrabKey(dpy, keycode, mods | Mod2Mask, root, False, GrabModeAsync, GrabModeAsync);
-      XGrabKey(dpy, keycode, mods | LockMask | Mod2Mask, root, False, GrabModeAsync, GrabModeAsync);
-    }
+    grab_startkey(startkey, 1);
   }
 
-  if (!strncmp(commands, "record", 6)) {
-    char *path = commands + 6;
+  if (first == cmd_record) {
+    char *path = program->commands[0].arg.str;
     char *newrecordingpath;
 
-    while (isspace(*path))
-      path++;
-
     /* If args is nonempty, try to use it as the file to store recordings in */
     if (path != NULL && path[0] != '\0') {
       /* Handle ~/ swapping in for actual homedir */
@@ -410,7 +904,7 @@ void addbinding(int keycode, int mods, char *commands) {
                 recordings_filename, path);
       } else {
         recordings_filename = newrecordingpath;
-        parse_recordings(recordings_filename);
+        recordings_load(recordings_filename);
       }
     }
   } /* special config handling for 'record' */
@@ -440,6 +934,7 @@ void parse_config_file(const char* file) {
     }
   } /* if file[0] == '~' */
 
+  config_cache_add_file(file);
   fp = fopen(file, "r");
 
   /* Silently ignore file read errors */
@@ -459,6 +954,7 @@ void parse_config_file(const char* file) {
 
     if (parse_config_line(line) != 0) {
       fprintf(stderr, "Error with config %s:%d: %s\n", file, lineno, line);
+      config_cache_error();
     }
   }
   fclose(fp);
@@ -466,11 +962,23 @@ void parse_config_file(const char* file) {
 
 void parse_config() {
   char *homedir;
+  long long load_start_us = now_us();
+  char *cache_path = config_cache_path();
+  uint32_t cache_key = config_cache_key();
 
-  keybindings = g_ptr_array_new();
+  keybindings = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                      NULL, keybinding_free);
   startkeys = g_ptr_array_new();
-  recordings = g_ptr_array_new();
+  recordings = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                     NULL, recording_free);
+
+  if (config_cache_replay(cache_path, cache_key) == 0) {
+    free(cache_path);
+    timing_record(TIMING_CONFIG_LOAD, load_start_us);
+    return;
+  }
 
+  config_cache_record_start();
   defaults();
   parse_config_file(GLOBAL_CONFIG_FILE);
   parse_config_file("~/.keynavrc");
@@ -487,6 +995,412 @@ void parse_config() {
     // standard default if XDG_CONFIG_HOME is not set
     parse_config_file("~/.config/keynav/keynavrc");
   }
+  config_cache_record_finish(cache_path, cache_key);
+  free(cache_path);
+  timing_record(TIMING_CONFIG_LOAD, load_start_us);
+}
+
+/* Parsing keynavrc means a keysym lookup and a modifier map scan for each
+ * binding and parsing every command string, so the result is kept in a
+ * binary cache: the replayable operations (clear, bind, directive) with
+ * their compiled programs, plus what they depended on, which is every
+ * config file consulted, the keyboard mapping, and the keynav version. If
+ * none of that changed, startup replays the cache instead of parsing
+ * text. */
+#define CONFIG_CACHE_MAGIC "KNCC"
+#define CONFIG_CACHE_FORMAT 2
+
+enum { CONFIG_OP_CLEAR, CONFIG_OP_BIND, CONFIG_OP_DIRECTIVE };
+
+typedef struct config_cache_header {
+  char magic[4];
+  uint32_t format;
+  char version[32];
+  uint32_t cache_key;
+  uint32_t nfiles;
+  uint32_t nops;
+} config_cache_header_t;
+
+/* Followed by the path, pathlen bytes */
+typedef struct config_cache_file {
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  int64_t size; /* -1 if the file did not exist */
+  uint32_t pathlen;
+} config_cache_file_t;
+
+/* Followed by the commands, textlen bytes, then ncommands compiled
+ * commands */
+typedef struct config_cache_op {
+  uint32_t type;
+  int32_t keycode;
+  int32_t mods;
+  uint32_t textlen;
+  uint32_t ncommands;
+} config_cache_op_t;
+
+/* A command_t; followed by its text, textlen bytes, and its string
+ * argument, arglen bytes. The dispatch index is only good for the keynav
+ * version that wrote it, which the header checks. */
+typedef struct config_cache_command {
+  uint32_t dispatch;
+  int32_t count;
+  float value;
+  int32_t num[2];
+  uint32_t textlen;
+  int32_t arglen; /* -1 if arg.str is NULL */
+} config_cache_command_t;
+
+typedef struct config_cache_recording {
+  GByteArray *files;
+  GByteArray *ops;
+  uint32_t nfiles;
+  uint32_t nops;
+  int errors;
+} config_cache_recording_t;
+
+static config_cache_recording_t *config_recording = NULL;
+
+char *config_cache_path() {
+  const char *cache_home = getenv("XDG_CACHE_HOME");
+  const char *homedir = getenv("HOME");
+  char *path = NULL;
+
+  if (cache_home != NULL && *cache_home != '\0') {
+    if (asprintf(&path, "%s/keynav/config.cache", cache_home) == -1)
+      return NULL;
+  } else if (homedir != NULL) {
+    if (asprintf(&path, "%s/.cache/keynav/config.cache", homedir) == -1)
+      return NULL;
+  }
+  return path;
+}
+
+/* FNV-1a over the keysym table and modifier map, since keycodes and
+ * modifier masks in the cache were resolved against them, and over the
+ * environment that decides which config files are read */
+uint32_t config_cache_key() {
+  uint32_t sum = 2166136261u;
+  int min_keycode, max_keycode, keysyms_per_keycode;
+  KeySym *keysyms;
+  XModifierKeymap *modmap;
+  int i;
+
+#define FNV_MIX(byte) do { sum ^= (unsigned char)(byte); sum *= 16777619u; } while (0)
+
+  XDisplayKeycodes(dpy, &min_keycode, &max_keycode);
+  keysyms = XGetKeyboardMapping(dpy, min_keycode,
+                                max_keycode - min_keycode + 1,
+                                &keysyms_per_keycode);
+  if (keysyms != NULL) {
+    int n = (max_keycode - min_keycode + 1) * keysyms_per_keycode;
+    for (i = 0; i < n; i++) {
+      FNV_MIX(keysyms[i]);
+      FNV_MIX(keysyms[i] >> 8);
+      FNV_MIX(keysyms[i] >> 16);
+      FNV_MIX(keysyms[i] >> 24);
+    }
+    XFree(keysyms);
+  }
+
+  modmap = XGetModifierMapping(dpy);
+  if (modmap != NULL) {
+    FNV_MIX(modmap->max_keypermod);
+    for (i = 0; i < 8 * modmap->max_keypermod; i++)
+      FNV_MIX(modmap->modifiermap[i]);
+    XFreeModifiermap(modmap);
+  }
+
+  const char *env[] = { "HOME", "XDG_CONFIG_HOME" };
+  for (i = 0; i < sizeof(env) / sizeof(*env); i++) {
+    const char *value = getenv(env[i]);
+    for (; value != NULL && *value != '\0'; value++)
+      FNV_MIX(*value);
+    FNV_MIX('\0');
+  }
+#undef FNV_MIX
+  return sum;
+}
+
+void config_cache_stat(const char *path, config_cache_file_t *file) {
+  struct stat st;
+
+  memset(file, 0, sizeof(*file));
+  file->pathlen = strlen(path);
+  if (stat(path, &st) == -1) {
+    file->size = -1;
+    return;
+  }
+  file->mtime_sec = st.st_mtim.tv_sec;
+  file->mtime_nsec = st.st_mtim.tv_nsec;
+  file->size = st.st_size;
+}
+
+/* Called by parse_config_file for every file it looks at */
+void config_cache_add_file(const char *path) {
+  config_cache_file_t file;
+
+  if (config_recording == NULL)
+    return;
+  config_cache_stat(path, &file);
+  g_byte_array_append(config_recording->files, (guint8 *)&file, sizeof(file));
+  g_byte_array_append(config_recording->files, (guint8 *)path, file.pathlen);
+  config_recording->nfiles++;
+}
+
+/* Parse errors would not be reported again when replaying, so a config with
+ * errors is not cached */
+void config_cache_error() {
+  if (config_recording != NULL)
+    config_recording->errors++;
+}
+
+void config_cache_add_op(int type, int keycode, int mods, const char *text,
+                         const program_t *program) {
+  GByteArray *ops;
+  config_cache_op_t op;
+  int i;
+
+  if (config_recording == NULL)
+    return;
+  ops = config_recording->ops;
+  op.type = type;
+  op.keycode = keycode;
+  op.mods = mods;
+  op.textlen = (text == NULL) ? 0 : strlen(text);
+  op.ncommands = (program == NULL) ? 0 : program->ncommands;
+  g_byte_array_append(ops, (guint8 *)&op, sizeof(op));
+  if (op.textlen > 0)
+    g_byte_array_append(ops, (guint8 *)text, op.textlen);
+
+  for (i = 0; i < op.ncommands; i++) {
+    const command_t *cmd = &(program->commands[i]);
+    config_cache_command_t ccmd;
+
+    ccmd.dispatch = cmd->dispatch - dispatch;
+    ccmd.count = cmd->arg.count;
+    ccmd.value = cmd->arg.value;
+    ccmd.num[0] = cmd->arg.num[0];
+    ccmd.num[1] = cmd->arg.num[1];
+    ccmd.textlen = strlen(cmd->text);
+    ccmd.arglen = (cmd->arg.str == NULL) ? -1 : strlen(cmd->arg.str);
+    g_byte_array_append(ops, (guint8 *)&ccmd, sizeof(ccmd));
+    g_byte_array_append(ops, (guint8 *)cmd->text, ccmd.textlen);
+    if (ccmd.arglen > 0)
+      g_byte_array_append(ops, (guint8 *)cmd->arg.str, ccmd.arglen);
+  }
+  config_recording->nops++;
+}
+
+/* Read back ncommands commands written by config_cache_add_op, advancing
+ * *pp. Returns NULL if they run past end or name no known command. */
+program_t *config_cache_read_program(const char **pp, const char *end,
+                                     uint32_t ncommands) {
+  static uint32_t ndispatch = 0;
+  const char *p = *pp;
+  program_t *program;
+  uint32_t i;
+
+  if (ndispatch == 0) {
+    while (dispatch[ndispatch].command != NULL)
+      ndispatch++;
+  }
+
+  program = calloc(sizeof(program_t), 1);
+  program->refs = 1;
+  program->commands = calloc(ncommands, sizeof(command_t));
+  for (i = 0; i < ncommands; i++) {
+    command_t *cmd = &(program->commands[i]);
+    config_cache_command_t ccmd;
+
+    if (end - p < sizeof(ccmd))
+      break;
+    memcpy(&ccmd, p, sizeof(ccmd));
+    p += sizeof(ccmd);
+    if (ccmd.dispatch >= ndispatch || end - p < ccmd.textlen
+        || (ccmd.arglen > 0 && end - p - ccmd.textlen < ccmd.arglen))
+      break;
+
+    cmd->dispatch = &dispatch[ccmd.dispatch];
+    cmd->arg.count = ccmd.count;
+    cmd->arg.value = ccmd.value;
+    cmd->arg.num[0] = ccmd.num[0];
+    cmd->arg.num[1] = ccmd.num[1];
+    cmd->text = strndup(p, ccmd.textlen);
+    p += ccmd.textlen;
+    if (ccmd.arglen >= 0) {
+      cmd->arg.str = strndup(p, ccmd.arglen);
+      p += ccmd.arglen;
+    }
+    program->ncommands++;
+  }
+
+  if (i < ncommands) {
+    program_free(program);
+    return NULL;
+  }
+  *pp = p;
+  return program;
+}
+
+void config_cache_record_start() {
+  config_recording = calloc(1, sizeof(config_cache_recording_t));
+  config_recording->files = g_byte_array_new();
+  config_recording->ops = g_byte_array_new();
+}
+
+/* Stop recording, and write the cache if the config parsed cleanly */
+void config_cache_record_finish(const char *path, uint32_t cache_key) {
+  config_cache_recording_t *rec = config_recording;
+  config_cache_header_t header;
+  char *tmppath = NULL, *dir, *slash;
+  FILE *fp;
+  int ok;
+
+  config_recording = NULL;
+  if (rec == NULL)
+    return;
+
+  if (rec->errors == 0 && path != NULL) {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CONFIG_CACHE_MAGIC, 4);
+    header.format = CONFIG_CACHE_FORMAT;
+    strncpy(header.version, KEYNAV_VERSION, sizeof(header.version) - 1);
+    header.cache_key = cache_key;
+    header.nfiles = rec->nfiles;
+    header.nops = rec->nops;
+
+    /* Write a temporary file and rename it over the cache so a concurrent
+     * keynav never maps a half-written cache */
+    dir = strdup(path);
+    slash = strrchr(dir, '/');
+    if (slash != NULL) {
+      *slash = '\0';
+      g_mkdir_with_parents(dir, 0700);
+    }
+    free(dir);
+
+    if (asprintf(&tmppath, "%s.%d", path, (int)getpid()) != -1) {
+      fp = fopen(tmppath, "w");
+      if (fp != NULL) {
+        ok = fwrite(&header, sizeof(header), 1, fp) == 1
+             && fwrite(rec->files->data, 1, rec->files->len, fp) == rec->files->len
+             && fwrite(rec->ops->data, 1, rec->ops->len, fp) == rec->ops->len;
+        ok = (fclose(fp) == 0) && ok;
+        if (!ok || rename(tmppath, path) != 0)
+          unlink(tmppath);
+      }
+      free(tmppath);
+    }
+  }
+
+  g_byte_array_free(rec->files, TRUE);
+  g_byte_array_free(rec->ops, TRUE);
+  free(rec);
+}
+
+/* Replay the cache at path if it is still valid. Returns 0 on success. */
+int config_cache_replay(const char *path, uint32_t cache_key) {
+  const config_cache_header_t *header;
+  const char *data, *p, *end;
+  struct {
+    config_cache_op_t op;
+    char *text;
+    program_t *program;
+  } *ops = NULL;
+  struct stat st;
+  uint32_t i;
+  int fd;
+  int ret = 1;
+
+  if (path == NULL)
+    return 1;
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return 1;
+  if (fstat(fd, &st) == -1 || st.st_size < sizeof(config_cache_header_t)) {
+    close(fd);
+    return 1;
+  }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return 1;
+
+  header = (const config_cache_header_t *)data;
+  p = data + sizeof(*header);
+  end = data + st.st_size;
+  if (memcmp(header->magic, CONFIG_CACHE_MAGIC, 4)
+      || header->format != CONFIG_CACHE_FORMAT
+      || strncmp(header->version, KEYNAV_VERSION, sizeof(header->version))
+      || header->cache_key != cache_key) {
+    goto out;
+  }
+
+  /* Every file must be just as it was when the cache was written */
+  for (i = 0; i < header->nfiles; i++) {
+    config_cache_file_t file, now;
+    char filepath[PATH_MAX];
+
+    if (end - p < sizeof(file))
+      goto out;
+    memcpy(&file, p, sizeof(file));
+    p += sizeof(file);
+    if (end - p < file.pathlen || file.pathlen >= sizeof(filepath))
+      goto out;
+    memcpy(filepath, p, file.pathlen);
+    filepath[file.pathlen] = '\0';
+    p += file.pathlen;
+
+    config_cache_stat(filepath, &now);
+    if (now.size != file.size || now.mtime_sec != file.mtime_sec
+        || now.mtime_nsec != file.mtime_nsec)
+      goto out;
+  }
+
+  /* Read every op, programs included, before applying any of them */
+  ops = calloc(header->nops, sizeof(*ops));
+  for (i = 0; i < header->nops; i++) {
+    if (end - p < sizeof(ops[i].op))
+      goto out;
+    memcpy(&(ops[i].op), p, sizeof(ops[i].op));
+    p += sizeof(ops[i].op);
+    if (end - p < ops[i].op.textlen)
+      goto out;
+    ops[i].text = strndup(p, ops[i].op.textlen);
+    p += ops[i].op.textlen;
+    if (ops[i].op.type != CONFIG_OP_CLEAR) {
+      ops[i].program = config_cache_read_program(&p, end, ops[i].op.ncommands);
+      if (ops[i].program == NULL || ops[i].program->ncommands == 0)
+        goto out;
+    }
+  }
+
+  for (i = 0; i < header->nops; i++) {
+    switch (ops[i].op.type) {
+      case CONFIG_OP_CLEAR:
+        config_clear();
+        break;
+      case CONFIG_OP_BIND:
+        addbinding_program(ops[i].op.keycode, ops[i].op.mods, ops[i].text,
+                           ops[i].program);
+        ops[i].program = NULL; /* the binding owns it now */
+        break;
+      case CONFIG_OP_DIRECTIVE:
+        program_run(ops[i].program);
+        break;
+    }
+  }
+  ret = 0;
+
+out:
+  for (i = 0; ops != NULL && i < header->nops; i++) {
+    free(ops[i].text);
+    program_free(ops[i].program);
+  }
+  free(ops);
+  munmap((void *)data, st.st_size);
+  return ret;
 }
 
 void defaults() {
@@ -540,11 +1454,33 @@ void defaults() {
     tmp = strdup(default_config[i]);
     if (parse_config_line(tmp) != 0) {
       fprintf(stderr, "Error with default config line %d: %s\n", i + 1, tmp);
+      config_cache_error();
     }
     free(tmp);
   }
 }
 
+/* Drop all keybindings and release the start key grabs */
+void config_clear() {
+  int i;
+
+  g_hash_table_remove_all(keybindings);
+
+  /* ungrab keybindings associated with start */
+  if (startkeys->len > 0) {
+    for (i = 0; i < startkeys->len; i++) {
+      grab_startkey(g_ptr_array_index(startkeys, i), 0);
+    }
+    /* The checks point at the key sequences, so collect before freeing */
+    grab_checks_collect();
+    for (i = 0; i < startkeys->len; i++) {
+      startkey_free(g_ptr_array_index(startkeys, i));
+    }
+    g_ptr_array_free(startkeys, TRUE);
+    startkeys = g_ptr_array_new();
+  }
+}
+
 int parse_config_line(char *orig_line) {
   /* syntax:
    * keysequence cmd1,cmd2,cmd3
@@ -559,7 +1495,6 @@ int parse_config_line(char *orig_line) {
   char *tokctx;
   char *keyseq;
   int keycode, mods;
-  int i, j;
   char *comment;
 
   /* Ignore everything after a '#' */
@@ -580,30 +1515,32 @@ int parse_config_line(char *orig_line) {
 
   /* A special config option that will clear all keybindings */
   if (strcmp(keyseq, "clear") == 0) {
-    /* TODO(sissel): Make this a cmd_clear function */
-    /* Reset keybindings */
-    g_ptr_array_free(keybindings, TRUE);
-    keybindings = g_ptr_array_new();
-
-    /* ungrab keybindings associated with start */
-    if (startkeys->len > 0) {
-      for (i = 0; i < ScreenCount(dpy); i++) {
-        Window root = RootWindow(dpy, i);
-        for (j = 0; j < startkeys->len; j++) {
-          startkey_t *sk = g_ptr_array_index(startkeys, j);
-          XUngrabKey(dpy, sk->keycode, sk->mods, root);
-          XUngrabKey(dpy, sk->keycode, sk->mods | LockMask, root);
-          XUngrabKey(dpy, sk->keycode, sk->mods | Mod2Mask, root);
-          XUngrabKey(dpy, sk->keycode, sk->mods | LockMask | Mod2Mask, root);
-        }
-      }
-      g_ptr_array_free(startkeys, TRUE);
-      startkeys = g_ptr_array_new();
+    config_clear();
+    config_cache_add_op(CONFIG_OP_CLEAR, 0, 0, NULL, NULL);
+  } else if (strcmp(keyseq, "daemonize") == 0
+             || strcmp(keyseq, "loadconfig") == 0
+             || strcmp(keyseq, "set") == 0) {
+    /* Commands that may appear on a line by themselves */
+    char *directive = NULL;
+    program_t *program;
+
+    if (tokctx != NULL && *tokctx != '\0') {
+      asprintf(&directive, "%s %s", keyseq, tokctx);
+    } else {
+      directive = strdup(keyseq);
+    }
+    program = program_compile(directive);
+    if (program == NULL) {
+      free(directive);
+      return 1;
     }
-  } else if (strcmp(keyseq, "daemonize") == 0) {
-    handle_commands(keyseq);
-  } else if (strcmp(keyseq, "loadconfig") == 0) {
-    handle_commands(keyseq);
+    /* loadconfig needs no op of its own: the lines of the file it loads
+     * are recorded as they are parsed */
+    if (strcmp(keyseq, "loadconfig") != 0)
+      config_cache_add_op(CONFIG_OP_DIRECTIVE, 0, 0, directive, program);
+    program_run(program);
+    program_free(program);
+    free(directive);
   } else {
     keycode = parse_keycode(keyseq);
     if (keycode == 0) {
@@ -620,7 +1557,11 @@ int parse_config_line(char *orig_line) {
       return 1;
     }
 
-    addbinding(keycode, mods, tokctx /* the remainder of the line */);
+    if (addbinding(keycode, mods, tokctx /* the remainder of the line */) != 0) {
+      return 1;
+    }
+    config_cache_add_op(CONFIG_OP_BIND, keycode, mods, tokctx,
+                        keybinding_lookup(keycode, mods)->program);
   }
 
   free(keyseq);
@@ -628,14 +1569,16 @@ int parse_config_line(char *orig_line) {
   return 0;
 }
 
-int percent_of(int num, char *args, float default_val) {
+int percent_of(int num, const cmdarg_t *arg, float default_val) {
   static float precision = 100000.0;
   float pct = 0.0;
   int value = 0;
 
-  /* Parse a float. If this fails, assume the default value */
-  if (sscanf(args, "%f", &pct) <= 0)
+  /* If no value was given, assume the default value */
+  if (arg == NULL || arg->count == 0)
     pct = default_val;
+  else
+    pct = arg->value;
 
   /* > 1, then it's not a percent, it's an absolute value. */
   if (pct > 1.0)
@@ -655,7 +1598,22 @@ void updatecliprects(wininfo_t *info, XRectangle **rectangles, int *nrects) {
   }
 }
 
-void updategrid(Window win, struct wininfo *info, int apply_clip, int draw) {
+/* Render the grid and, if an atlas is given, its labels for info into cr.
+ * cr may target any cairo surface; clip_rectangles is filled with the
+ * shape of what was drawn. */
+void render_grid(cairo_t *cr, label_atlas_t *atlas, wininfo_t *info) {
+  updatecliprects(info, &clip_rectangles, &nclip_rectangles);
+  memset(clip_rectangles, 0, nclip_rectangles * sizeof(XRectangle));
+
+  updategrid(cr, info, clip_rectangles);
+  if (atlas != NULL) {
+    updategridtext(cr, atlas, info, clip_rectangles);
+  }
+}
+
+/* Draw the grid lines into cr. If rects is not NULL, the grid line clip
+ * rectangles are written to the start of it. */
+void updategrid(cairo_t *cr, struct wininfo *info, XRectangle *rects) {
   double w = info->w;
   double h = info->h;
   double cell_width;
@@ -663,31 +1621,17 @@ void updategrid(Window win, struct wininfo *info, int apply_clip, int draw) {
   int i;
   int rect = 0;
 
-  if (apply_clip) {
-    updatecliprects(info, &clip_rectangles, &nclip_rectangles);
-    memset(clip_rectangles, 0, nclip_rectangles * sizeof(XRectangle));
-  }
-
-#ifdef PROFILE_THINGS
-  struct timespec start, end;
-  clock_gettime(CLOCK_MONOTONIC, &start);
-#endif
-
   if (w <= 4 || h <= 4) {
-      cairo_new_path(canvas_cairo);
-      cairo_fill(canvas_cairo);
+      cairo_new_path(cr);
+      cairo_fill(cr);
       return;
   }
 
-  //printf("updategrid: clip:%d, draw:%d\n", apply_clip, draw);
-
-  if (draw) {
-    cairo_new_path(canvas_cairo);
-    cairo_set_source_rgb(canvas_cairo, 1, 1, 1);
-    cairo_rectangle(canvas_cairo, 0, 0, w, h);
-    cairo_set_line_width(canvas_cairo, wininfo.border_thickness);
-    cairo_fill(canvas_cairo);
-  }
+  cairo_new_path(cr);
+  cairo_set_source_rgb(cr, 1, 1, 1);
+  cairo_rectangle(cr, 0, 0, w, h);
+  cairo_set_line_width(cr, info->border_thickness);
+  cairo_fill(cr);
 
   cell_width = (w / info->grid_cols);
   cell_height = (h / info->grid_rows);
@@ -710,14 +1654,16 @@ void updategrid(Window win, struct wininfo *info, int apply_clip, int draw) {
         x_w_off = info->border_thickness / 2;
     }
 
-    cairo_move_to(canvas_cairo, x_total_offset + 1, 0);
-    cairo_line_to(canvas_cairo, x_total_offset + 1, info->h);
+    cairo_move_to(cr, x_total_offset + 1, 0);
+    cairo_line_to(cr, x_total_offset + 1, info->h);
 
-    clip_rectangles[rect].x = x_total_offset + x_off;
-    clip_rectangles[rect].y = 0;
-    clip_rectangles[rect].width = info->border_thickness - x_w_off;
-    clip_rectangles[rect].height = info->h;
-    rect++;
+    if (rects != NULL) {
+      rects[rect].x = x_total_offset + x_off;
+      rects[rect].y = 0;
+      rects[rect].width = info->border_thickness - x_w_off;
+      rects[rect].height = info->h;
+      rect++;
+    }
 
     x_total_offset += cell_width;
   }
@@ -740,199 +1686,740 @@ void updategrid(Window win, struct wininfo *info, int apply_clip, int draw) {
         y_w_off = info->border_thickness / 2;
     }
 
-    cairo_move_to(canvas_cairo, 0, y_total_offset + 1);
-    cairo_line_to(canvas_cairo, info->w, y_total_offset + 1);
-
-    clip_rectangles[rect].x = 0;
-    clip_rectangles[rect].y = y_total_offset + y_off;
+    cairo_move_to(cr, 0, y_total_offset + 1);
+    cairo_line_to(cr, info->w, y_total_offset + 1);
 
-    clip_rectangles[rect].width = info->w;
-    clip_rectangles[rect].height = info->border_thickness - y_w_off;
-    rect++;
+    if (rects != NULL) {
+      rects[rect].x = 0;
+      rects[rect].y = y_total_offset + y_off;
+      rects[rect].width = info->w;
+      rects[rect].height = info->border_thickness - y_w_off;
+      rect++;
+    }
 
     y_total_offset += cell_height;
   }
 
-  cairo_path_t *path = cairo_copy_path(canvas_cairo);
+  cairo_set_source_rgba(cr, 0, 0, 0, 1.0);
+  cairo_set_line_width(cr, 1);
+  cairo_stroke(cr);
+}
 
-#ifdef PROFILE_THINGS
-  clock_gettime(CLOCK_MONOTONIC, &end);
-  printf("updategrid pathbuild time: %ld.%09ld\n",
-         end.tv_sec - start.tv_sec,
-         end.tv_nsec - start.tv_nsec);
-  clock_gettime(CLOCK_MONOTONIC, &start);
-#endif
+/* Draw the label of every cell under node into cr */
+static void updategridtext_subtree(cairo_t *cr, label_atlas_t *atlas,
+                                   struct wininfo *info, XRectangle *rects,
+                                   const grid_labels_t *labels, int node,
+                                   int highlight) {
+  const label_node_t *n = &(labels->nodes[node]);
+  int symbols[LABEL_MAX_LENGTH];
+  int i, len;
+
+  if (n->children >= 0) {
+    for (i = 0; i < labels->nsymbols; i++) {
+      updategridtext_subtree(cr, atlas, info, rects, labels, n->children + i,
+                             highlight);
+    }
+    return;
+  }
+  if (n->cell < 0) {
+    return;
+  }
 
-  if (draw) {
-    cairo_set_source_rgba(canvas_cairo, 0, 0, 0, 1.0);
-    cairo_set_line_width(canvas_cairo, 1);
-    cairo_stroke(canvas_cairo);
-
-#ifdef PROFILE_THINGS
-    XSync(dpy, False);
-    clock_gettime(CLOCK_MONOTONIC, &end);
-    printf("updategrid draw time: %ld.%09ld\n",
-           end.tv_sec - start.tv_sec,
-           end.tv_nsec - start.tv_nsec);
-    clock_gettime(CLOCK_MONOTONIC, &start);
-#endif
-  } /* if draw */
+  /* Spell the label by walking back up to the root */
+  len = n->depth;
+  for (i = node; i > 0; i = labels->nodes[i].parent) {
+    symbols[labels->nodes[i].depth - 1] = labels->nodes[i].symbol;
+  }
+
+  int row = n->cell / info->grid_cols;
+  int col = n->cell % info->grid_cols;
+  double cell_width = (double)(info->w - info->border_thickness) / info->grid_cols;
+  double cell_height = (double)(info->h - info->border_thickness) / info->grid_rows;
+  int xpos = cell_width * col + info->border_thickness / 2 + (cell_width / 2);
+  int ypos = cell_height * row + info->border_thickness / 2 + (cell_height / 2);
+  int boxw = len * atlas->glyph_w + 2 * LABEL_PAD_X;
+  int boxh = atlas->rectheight;
+  int boxx = xpos - boxw / 2;
+  int boxy = ypos - boxh / 2;
+
+  cairo_rectangle(cr, boxx, boxy, boxw, boxh);
+  if (highlight) {
+    cairo_set_source_rgb(cr, 0, .3, .3);
+  } else {
+    cairo_set_source_rgb(cr, 0, .2, 0);
+  }
+  cairo_fill_preserve(cr);
+  cairo_set_source_rgb(cr, .8, .8, 0);
+  cairo_set_line_width(cr, 1);
+  cairo_stroke(cr);
+
+  for (i = 0; i < len; i++) {
+    int glyphx = boxx + LABEL_PAD_X + i * atlas->glyph_w;
+    int glyphy = boxy + LABEL_PAD_Y;
+    cairo_set_source_surface(cr, atlas->surface,
+                             glyphx - symbols[i] * atlas->glyph_w,
+                             glyphy - (highlight ? atlas->glyph_h : 0));
+    cairo_rectangle(cr, glyphx, glyphy, atlas->glyph_w, atlas->glyph_h);
+    cairo_fill(cr);
+  }
 
-  cairo_path_destroy(path);
+  if (rects != NULL) {
+    XRectangle *rect = &(rects[info->grid_cols + 1 + info->grid_rows + 1
+                              + n->cell]);
+    rect->x = boxx;
+    rect->y = boxy;
+    rect->width = boxw + 1;
+    rect->height = boxh + 1;
+  }
 }
 
-void updategridtext(Window win, struct wininfo *info, int apply_clip, int draw) {
-  double w = info->w;
-  double h = info->h;
-  double cell_width;
-  double cell_height;
-  double x_off, y_off;
-  int row, col;
+/* Draw the grid-nav labels into cr, using letters from atlas. Only labels
+ * that can still be reached from what was typed so far are drawn, and
+ * they are highlighted. If rects is not NULL, each drawn label's clip
+ * rectangle is written after the grid line ones; the rest are left alone. */
+void updategridtext(cairo_t *cr, label_atlas_t *atlas, struct wininfo *info,
+                    XRectangle *rects) {
+  grid_labels_t *labels = grid_labels_get(info->grid_rows, info->grid_cols);
+  int prefix = grid_nav_prefix(info);
+
+  updategridtext_subtree(cr, atlas, info, rects, labels, prefix, prefix > 0);
+} /* void updategridtext */
 
-  int rect = (info->grid_cols + 1 + info->grid_rows + 1); /* start at end of grid lines */
+/* The alphabet labels are spelled with */
+const char *label_alphabet_get() {
+  return (label_alphabet != NULL ? label_alphabet : LABEL_ALPHABET_DEFAULT);
+}
 
-  x_off = info->border_thickness / 2;
-  y_off = info->border_thickness / 2;
+/* Add nsymbols children under node, none of them labelling anything yet.
+ * This may move labels->nodes. */
+static void label_node_expand(grid_labels_t *labels, int node) {
+  int i;
 
-  cairo_text_extents_t te;
-#define FONTSIZE 18
-  if (draw) {
-    cairo_new_path(canvas_cairo);
-    cairo_select_font_face(canvas_cairo, "Courier", CAIRO_FONT_SLANT_NORMAL,
-                           CAIRO_FONT_WEIGHT_BOLD);
-    cairo_set_font_size(canvas_cairo, FONTSIZE);
-    cairo_text_extents(canvas_cairo, "AA", &te);
+  labels->nodes = realloc(labels->nodes, (labels->nnodes + labels->nsymbols)
+                                         * sizeof(label_node_t));
+  labels->nodes[node].children = labels->nnodes;
+  for (i = 0; i < labels->nsymbols; i++) {
+    label_node_t *child = &(labels->nodes[labels->nnodes++]);
+    child->parent = node;
+    child->symbol = i;
+    child->depth = labels->nodes[node].depth + 1;
+    child->children = -1;
+    child->cell = -1;
   }
+}
 
-  w -= info->border_thickness;
-  h -= info->border_thickness;
-  cell_width = (w / info->grid_cols);
-  cell_height = (h / info->grid_rows);
+/* Digits of base nsymbols needed to write every number below count */
+static int label_digits(int nsymbols, int count) {
+  long long reach = nsymbols;
+  int digits = 1;
 
-  h++;
-  w++;
-
-  //printf("bearing: %f,%f\n", te.x_bearing, te.y_bearing);
-  //printf("size: %f,%f\n", te.width, te.height);
-
-  char label[3] = "AA";
-
-  int row_selected = 0;
-  for (col = 0; col < info->grid_cols; col++) {
-    label[0] = 'A';
-    for (row = 0; row < info->grid_rows; row++) {
-      int rectwidth = te.width + 25;
-      int rectheight = te.height + 8;
-      int xpos = cell_width * col + x_off + (cell_width / 2);
-      int ypos = cell_height * row + y_off + (cell_height / 2);
-
-      row_selected = (appstate.grid_nav && appstate.grid_nav_row == row
-                      && appstate.grid_nav_state == GRID_NAV_COL);
-      //printf("Grid: %c%c\n", label[0], label[1]);
-
-      /* If the current column is the one selected by grid nav, use
-       * a different color */
-      //printf("Grid geom: %fx%f @ %d,%d\n",
-             //xpos - rectwidth / 2 + te.x_bearing / 2,
-             //ypos - rectheight / 2 + te.y_bearing / 2,
-             //rectwidth, rectheight);
-      cairo_rectangle(canvas_cairo,
-                      xpos - rectwidth / 2 + te.x_bearing / 2,
-                      ypos - rectheight / 2 + te.y_bearing / 2,
-                      rectwidth, rectheight);
-      if (draw) {
-        cairo_path_t *pathcopy;
-        pathcopy = cairo_copy_path(canvas_cairo);
-        cairo_set_line_width(shape_cairo, 2);
-
-        if (row_selected) {
-          cairo_set_source_rgb(canvas_cairo, 0, .3, .3);
-        } else {
-          cairo_set_source_rgb(canvas_cairo, 0, .2, 0);
-        }
-        cairo_fill(canvas_cairo);
-        cairo_append_path(canvas_cairo, pathcopy);
-        cairo_set_source_rgb(canvas_cairo, .8, .8, 0);
-        cairo_stroke(canvas_cairo);
-        cairo_path_destroy(pathcopy);
-
-        if (row_selected) {
-          cairo_set_source_rgb(canvas_cairo, 1, 1, 1);
-        } else {
-          cairo_set_source_rgb(canvas_cairo, .8, .8, .8);
-        }
-        cairo_fill(canvas_cairo);
-        cairo_move_to(canvas_cairo, xpos - te.width / 2, ypos);
-        cairo_show_text(canvas_cairo, label);
-      }
+  while (reach < count) {
+    reach *= nsymbols;
+    digits++;
+  }
+  return digits;
+}
 
-      if (apply_clip) {
-        clip_rectangles[rect].x = xpos - rectwidth / 2 + te.x_bearing / 2;
-        clip_rectangles[rect].y = ypos - rectheight / 2 + te.y_bearing / 2;
-        clip_rectangles[rect].width = rectwidth + 1;
-        clip_rectangles[rect].height =  rectheight + 1;
-        rect++;
-      }
-      label[0]++;
-    }
-    label[1]++;
-  } /* Draw rectangles and text */
-} /* void updategridtext */
+/* Row digits then column digits, each zero-padded to the same width */
+static void grid_labels_build_rowcol(grid_labels_t *labels) {
+  int row_digits = label_digits(labels->nsymbols, labels->rows);
+  int col_digits = label_digits(labels->nsymbols, labels->cols);
+  int digits[LABEL_MAX_LENGTH];
+  int row, col, i, v;
+
+  if (row_digits + col_digits > LABEL_MAX_LENGTH) {
+    fprintf(stderr, "Grid %dx%d needs labels longer than %d letters; "
+            "try a larger label-alphabet\n", labels->cols, labels->rows,
+            LABEL_MAX_LENGTH);
+    return;
+  }
 
-void grab_keyboard() {
-  int grabstate;
-  int grabtries = 0;
+  for (row = 0; row < labels->rows; row++) {
+    for (col = 0; col < labels->cols; col++) {
+      int node = 0;
 
-  /* This loop is to work around the following scenario:
-   * xbindkeys invokes XGrabKeyboard when you press a bound keystroke and
-   * doesn't Ungrab until you release a key.
-   * Example: (xbindkey '(Control semicolon) "keynav 'start, grid 2x2'")
-   * This will only invoke XUngrabKeyboard when you release 'semicolon'
-   *
-   * The problem is that keynav would be launched as soon as the keydown
-   * event 'control + semicolon' occurs, but we could only get the grab on
-   * the release.
-   *
-   * This sleepyloop will keep trying to grab the keyboard until it succeeds.
-   *
-   * Reported by Colin Shea
-   */
-  grabstate = XGrabKeyboard(dpy, viewports[wininfo.curviewport].root, False,
-                            GrabModeAsync, GrabModeAsync, CurrentTime);
-  while (grabstate != GrabSuccess) {
-    usleep(10000); /* sleep for 10ms */
-    grabstate = XGrabKeyboard(dpy, viewports[wininfo.curviewport].root, False,
-                              GrabModeAsync, GrabModeAsync, CurrentTime);
-    grabtries += 1;
-    if (grabtries >= 20) {
-      fprintf(stderr, "XGrabKeyboard failed %d times, giving up...\n",
-              grabtries);
-
-      /* Returning from here will result in the appstate.active still
-       * being false. */
-      return;
+      for (i = row_digits - 1, v = row; i >= 0; i--, v /= labels->nsymbols)
+        digits[i] = v % labels->nsymbols;
+      for (i = col_digits - 1, v = col; i >= 0; i--, v /= labels->nsymbols)
+        digits[row_digits + i] = v % labels->nsymbols;
+
+      for (i = 0; i < row_digits + col_digits; i++) {
+        if (labels->nodes[node].children < 0)
+          label_node_expand(labels, node);
+        node = labels->nodes[node].children + digits[i];
+      }
+      labels->nodes[node].cell = row * labels->cols + col;
+      labels->leaves[row * labels->cols + col] = node;
     }
   }
-  //printf("Got grab!\n");
 }
 
-void cmd_start(char *args) {
-  XSetWindowAttributes winattr;
+/* Expand the shallowest leaves until there are enough for every cell.
+ * Nodes are created breadth-first, so the unexpanded ones are always the
+ * tail of the node array and the cells get the shortest of them. */
+static void grid_labels_build_hint(grid_labels_t *labels) {
+  int ncells = labels->rows * labels->cols;
+  int expanded = 0;
   int i;
-  int screen;
 
-  screen = query_current_screen();
-  wininfo.curviewport = screen;
+  if (label_digits(labels->nsymbols, ncells) > LABEL_MAX_LENGTH) {
+    fprintf(stderr, "Grid %dx%d needs labels longer than %d letters; "
+            "try a larger label-alphabet\n", labels->cols, labels->rows,
+            LABEL_MAX_LENGTH);
+    return;
+  }
 
-  appstate.grid_nav_row = -1;
-  appstate.grid_nav_col = -1;
+  while (expanded == 0 || labels->nnodes - expanded < ncells) {
+    label_node_expand(labels, expanded);
+    expanded++;
+  }
+  for (i = 0; i < ncells; i++) {
+    labels->nodes[expanded + i].cell = i;
+    labels->leaves[i] = expanded + i;
+  }
+}
 
-  wininfo.x = viewports[wininfo.curviewport].x;
-  wininfo.y = viewports[wininfo.curviewport].y;
-  wininfo.w = viewports[wininfo.curviewport].w;
-  wininfo.h = viewports[wininfo.curviewport].h;
+/* Return the labels for a grid, building them if the grid or the label
+ * settings changed since last time. Building is deterministic, so node
+ * numbers stay meaningful across rebuilds for the same grid. */
+grid_labels_t *grid_labels_get(int rows, int cols) {
+  grid_labels_t *labels = &grid_labels;
+  int i;
 
-  grab_keyboard();
+  if (labels->nodes != NULL && labels->generation == label_generation
+      && labels->rows == rows && labels->cols == cols) {
+    return labels;
+  }
+
+  labels->generation = label_generation;
+  labels->rows = rows;
+  labels->cols = cols;
+  labels->nsymbols = strlen(label_alphabet_get());
+  labels->nnodes = 1;
+  labels->nodes = realloc(labels->nodes, sizeof(label_node_t));
+  labels->nodes[0].parent = -1;
+  labels->nodes[0].symbol = -1;
+  labels->nodes[0].depth = 0;
+  labels->nodes[0].children = -1;
+  labels->nodes[0].cell = -1;
+  labels->leaves = realloc(labels->leaves, rows * cols * sizeof(int));
+  for (i = 0; i < rows * cols; i++) {
+    labels->leaves[i] = -1;
+  }
+
+  if (label_style != NULL && !strcmp(label_style, "hint")) {
+    grid_labels_build_hint(labels);
+  } else {
+    grid_labels_build_rowcol(labels);
+  }
+  return labels;
+}
+
+/* The node reached by typing symbol at node, or -1 if no label goes on
+ * that way */
+int label_child(const grid_labels_t *labels, int node, int symbol) {
+  const label_node_t *child;
+
+  if (node < 0 || node >= labels->nnodes || labels->nodes[node].children < 0)
+    return -1;
+  child = &(labels->nodes[labels->nodes[node].children + symbol]);
+  if (child->children < 0 && child->cell < 0)
+    return -1;
+  return labels->nodes[node].children + symbol;
+}
+
+/* The label trie node typed so far, if it belongs to this grid */
+int grid_nav_prefix(const wininfo_t *info) {
+  if (!appstate.grid_nav || info->grid_rows != appstate.grid_nav_rows
+      || info->grid_cols != appstate.grid_nav_cols) {
+    return 0;
+  }
+  return appstate.grid_nav_node;
+}
+
+/* Map the keycode of each alphabet letter to its index */
+static void label_keys_update() {
+  const char *alphabet = label_alphabet_get();
+  int i;
+
+  if (label_keys_generation == label_generation)
+    return;
+  label_keys_generation = label_generation;
+  for (i = 0; i < 256; i++) {
+    label_keys[i] = -1;
+  }
+  for (i = 0; alphabet[i] != '\0'; i++) {
+    /* Keysyms for printable ASCII are the characters themselves */
+    KeyCode keycode = XKeysymToKeycode(dpy, tolower(alphabet[i]));
+    if (keycode != 0)
+      label_keys[keycode] = i;
+  }
+}
+
+/* Check that every letter of an alphabet can be typed, and typed with a
+ * key of its own */
+static int label_alphabet_valid(const char *alphabet) {
+  int seen[256];
+  int i;
+
+  if (strlen(alphabet) < 2) {
+    fprintf(stderr, "label-alphabet needs at least 2 letters\n");
+    return 0;
+  }
+  memset(seen, 0, sizeof(seen));
+  for (i = 0; alphabet[i] != '\0'; i++) {
+    KeyCode keycode = 0;
+    if (isgraph(alphabet[i]))
+      keycode = XKeysymToKeycode(dpy, tolower(alphabet[i]));
+    if (keycode == 0) {
+      fprintf(stderr, "label-alphabet: no key types '%c'\n", alphabet[i]);
+      return 0;
+    }
+    if (seen[keycode]) {
+      fprintf(stderr, "label-alphabet: '%c' and '%c' are the same key\n",
+              alphabet[seen[keycode] - 1], alphabet[i]);
+      return 0;
+    }
+    seen[keycode] = i + 1;
+  }
+  return 1;
+}
+
+/* Called when label-alphabet or label-style is set */
+void labels_changed() {
+  if (label_alphabet != NULL && !label_alphabet_valid(label_alphabet)) {
+    fprintf(stderr, "Using the default label-alphabet, %s\n",
+            LABEL_ALPHABET_DEFAULT);
+    free(label_alphabet);
+    label_alphabet = NULL;
+  }
+  if (label_style != NULL && strcmp(label_style, "rowcol")
+      && strcmp(label_style, "hint")) {
+    fprintf(stderr, "Unknown label-style '%s', expected rowcol or hint\n",
+            label_style);
+    free(label_style);
+    label_style = NULL;
+  }
+
+  label_generation++;
+  appstate.grid_nav_node = 0;
+  label_atlases_invalidate();
+}
+
+/* Return the label atlas for a screen, drawing it if this is the first use
+ * or the label font changed since it was drawn. */
+label_atlas_t *label_atlas_get(int screen_num) {
+  Screen *screen = ScreenOfDisplay(dpy, screen_num);
+  label_atlas_t *atlas;
+
+  if (label_atlases == NULL) {
+    label_atlases = calloc(ScreenCount(dpy), sizeof(label_atlas_t));
+  }
+
+  atlas = &(label_atlases[screen_num]);
+  if (atlas->surface != NULL && atlas->generation == label_atlas_generation) {
+    return atlas;
+  }
+
+  if (atlas->surface != NULL) {
+    cairo_surface_destroy(atlas->surface);
+    XFreePixmap(dpy, atlas->pixmap);
+  }
+
+  label_atlas_measure(atlas);
+  atlas->pixmap = XCreatePixmap(dpy, RootWindowOfScreen(screen),
+                                atlas->width, atlas->height,
+                                screen->root_depth);
+  atlas->surface = cairo_xlib_surface_create(dpy, atlas->pixmap,
+                                             screen->root_visual,
+                                             atlas->width, atlas->height);
+  label_atlas_paint(atlas);
+  return atlas;
+}
+
+/* Size the atlas tiles for the current label font and alphabet. The atlas
+ * surface must then be atlas->width by atlas->height. */
+void label_atlas_measure(label_atlas_t *atlas) {
+  const char *font = (label_font != NULL ? label_font : LABEL_FONT_DEFAULT);
+  const char *alphabet = label_alphabet_get();
+  cairo_surface_t *scratch;
+  cairo_text_extents_t te;
+  cairo_t *cr;
+  char letter[2] = "A";
+  int i;
+
+  scratch = cairo_image_surface_create(CAIRO_FORMAT_RGB24, 1, 1);
+  cr = cairo_create(scratch);
+  cairo_select_font_face(cr, font, CAIRO_FONT_SLANT_NORMAL,
+                         CAIRO_FONT_WEIGHT_BOLD);
+  cairo_set_font_size(cr, label_font_size);
+
+  /* Tiles are as wide as the widest letter and as tall as all of them */
+  atlas->glyph_w = 1;
+  for (i = 0; alphabet[i] != '\0'; i++) {
+    letter[0] = toupper(alphabet[i]);
+    cairo_text_extents(cr, letter, &te);
+    atlas->glyph_w = MAX(atlas->glyph_w, (int)(te.x_advance + 0.5));
+  }
+  char *upper = g_ascii_strup(alphabet, -1);
+  cairo_text_extents(cr, upper, &te);
+  g_free(upper);
+  cairo_destroy(cr);
+  cairo_surface_destroy(scratch);
+
+  atlas->generation = label_atlas_generation;
+  atlas->glyph_h = te.height + 2;
+  atlas->rectheight = atlas->glyph_h + 2 * LABEL_PAD_Y;
+  atlas->width = atlas->glyph_w * strlen(alphabet);
+  atlas->height = atlas->glyph_h * 2;
+}
+
+/* Draw every letter into atlas->surface, which may be any cairo surface.
+ * The first row of tiles is plain, the second highlighted. */
+void label_atlas_paint(label_atlas_t *atlas) {
+  const char *font = (label_font != NULL ? label_font : LABEL_FONT_DEFAULT);
+  const char *alphabet = label_alphabet_get();
+  cairo_text_extents_t te;
+  cairo_t *cr;
+  char letter[2] = "A";
+  int variant, i;
+
+  cr = cairo_create(atlas->surface);
+  cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
+  cairo_select_font_face(cr, font, CAIRO_FONT_SLANT_NORMAL,
+                         CAIRO_FONT_WEIGHT_BOLD);
+  cairo_set_font_size(cr, label_font_size);
+
+  /* Share one baseline so letters line up when put side by side */
+  char *upper = g_ascii_strup(alphabet, -1);
+  cairo_text_extents(cr, upper, &te);
+  g_free(upper);
+  double baseline = 1 - te.y_bearing;
+
+  for (variant = 0; variant < 2; variant++) {
+    for (i = 0; alphabet[i] != '\0'; i++) {
+      double x = i * atlas->glyph_w;
+      double y = variant * atlas->glyph_h;
+      cairo_text_extents_t le;
+
+      cairo_rectangle(cr, x, y, atlas->glyph_w, atlas->glyph_h);
+      if (variant) {
+        cairo_set_source_rgb(cr, 0, .3, .3);
+      } else {
+        cairo_set_source_rgb(cr, 0, .2, 0);
+      }
+      cairo_fill(cr);
+
+      if (variant) {
+        cairo_set_source_rgb(cr, 1, 1, 1);
+      } else {
+        cairo_set_source_rgb(cr, .8, .8, .8);
+      }
+      letter[0] = toupper(alphabet[i]);
+      cairo_text_extents(cr, letter, &le);
+      cairo_move_to(cr, x + (atlas->glyph_w - le.x_advance) / 2, y + baseline);
+      cairo_show_text(cr, letter);
+    }
+  }
+  cairo_destroy(cr);
+}
+
+void label_atlases_invalidate() {
+  label_atlas_generation++;
+  frame_caches_clear();
+}
+
+int grab_keyboard() {
+  int grabstate;
+
+  /* This loop is to work around the following scenario:
+   * xbindkeys invokes XGrabKeyboard when you press a bound keystroke and
+   * doesn't Ungrab until you release a key.
+   * Example: (xbindkey '(Control semicolon) "keynav 'start, grid 2x2'")
+   * This will only invoke XUngrabKeyboard when you release 'semicolon'
+   *
+   * The problem is that keynav would be launched as soon as the keydown
+   * event 'control + semicolon' occurs, but we could only get the grab on
+   * the release.
+   *
+   * If the grab fails we mark it pending and the main loop retries it
+   * when the other client's grab is likely gone: on KeyRelease, on the
+   * focus events with mode NotifyUngrab that end a grab (the root gets a
+   * FocusOut, or a FocusIn when focus is PointerRoot), or on an XKB state
+   * change. Failing those, it polls every GRAB_POLL_US.
+   *
+   * Reported by Colin Shea
+   */
+  grabstate = XGrabKeyboard(dpy, viewports[wininfo.curviewport].root, False,
+                            GrabModeAsync, GrabModeAsync, CurrentTime);
+  /* Only a grab that had to wait is timed (in grab_retry); counting the
+   * ones that succeed at once would bury those waits in zeros */
+  if (grabstate == GrabSuccess)
+    return 1;
+
+  if (!grab_pending) {
+    grab_pending = 1;
+    grab_wait_start_us = now_us();
+    grab_deadline_us = grab_wait_start_us + GRAB_TIMEOUT_US;
+  }
+  return 0;
+}
+
+/* Queue a command string to run once the pending keyboard grab succeeds */
+void grab_queue_push(char *commands) {
+  if (grab_queue == NULL)
+    grab_queue = g_queue_new();
+  g_queue_push_tail(grab_queue, commands);
+}
+
+/* Try again to take a keyboard grab that failed earlier. On success, run
+ * the commands that were waiting for it. */
+void grab_retry() {
+  char *commands;
+  int grabstate;
+
+  if (!grab_pending)
+    return;
+
+  grabstate = XGrabKeyboard(dpy, viewports[wininfo.curviewport].root, False,
+                            GrabModeAsync, GrabModeAsync, CurrentTime);
+  if (grabstate != GrabSuccess) {
+    if (now_us() < grab_deadline_us)
+      return;
+
+    fprintf(stderr, "XGrabKeyboard failed for %dms, giving up...\n",
+            GRAB_TIMEOUT_US / 1000);
+    grab_pending = 0;
+    while (grab_queue && (commands = g_queue_pop_head(grab_queue)) != NULL)
+      free(commands);
+    return;
+  }
+
+  grab_pending = 0;
+  timing_record(TIMING_GRAB_WAIT, grab_wait_start_us);
+
+  /* Each queued string begins with a start command, which grabs again
+   * (harmless, we already hold it) and activates. */
+  while (grab_queue && (commands = g_queue_pop_head(grab_queue)) != NULL) {
+    handle_commands(commands);
+    free(commands);
+  }
+}
+
+/* Per screen, whether a compositing manager owns _NET_WM_CM_Sn. Looked up
+ * once at startup so building an overlay costs no round trip, then kept
+ * current from XFixes selection events. */
+static Atom *compositor_atoms = NULL;
+static int *compositor_running = NULL;
+static int xfixes_event_base = -1;
+
+void compositors_query() {
+  int xfixes_error_base;
+  int screen;
+
+  if (!XFixesQueryExtension(dpy, &xfixes_event_base, &xfixes_error_base))
+    xfixes_event_base = -1;
+
+  compositor_atoms = calloc(ScreenCount(dpy), sizeof(Atom));
+  compositor_running = calloc(ScreenCount(dpy), sizeof(int));
+  for (screen = 0; screen < ScreenCount(dpy); screen++) {
+    char name[32];
+    snprintf(name, sizeof(name), "_NET_WM_CM_S%d", screen);
+    compositor_atoms[screen] = XInternAtom(dpy, name, False);
+    compositor_running[screen] =
+      (XGetSelectionOwner(dpy, compositor_atoms[screen]) != None);
+    if (xfixes_event_base >= 0) {
+      XFixesSelectSelectionInput(dpy, RootWindow(dpy, screen),
+                                 compositor_atoms[screen],
+                                 XFixesSetSelectionOwnerNotifyMask
+                                 | XFixesSelectionWindowDestroyNotifyMask
+                                 | XFixesSelectionClientCloseNotifyMask);
+    }
+  }
+}
+
+/* A compositor started or went away. Prebuilt overlays have the visual
+ * picked when they were made, so build them again. */
+void compositor_changed(const XFixesSelectionNotifyEvent *e) {
+  int screen;
+
+  for (screen = 0; screen < ScreenCount(dpy); screen++) {
+    if (e->selection != compositor_atoms[screen]
+        || e->window != RootWindow(dpy, screen))
+      continue;
+    if (compositor_running[screen] == (e->owner != None))
+      return;
+    compositor_running[screen] = (e->owner != None);
+    if (persistent_overlay)
+      overlays_rebuild();
+    return;
+  }
+}
+
+/* Whether an overlay on this viewport can be an ARGB window: a
+ * compositing manager runs on the screen and there is a 32-bit TrueColor
+ * visual. Without a compositor, transparent pixels would not be blended,
+ * so the shaped window is used instead. */
+int overlay_wants_argb(const viewport_t *viewport, XVisualInfo *vinfo) {
+  if (!argb_overlay || compositor_running == NULL
+      || !compositor_running[viewport->screen_num])
+    return 0;
+
+  return XMatchVisualInfo(dpy, viewport->screen_num, 32, TrueColor, vinfo);
+}
+
+overlay_t *overlay_new(viewport_t *viewport) {
+  XSetWindowAttributes winattr;
+  XVisualInfo vinfo;
+  Visual *visual = viewport->screen->root_visual;
+  overlay_t *ov = calloc(sizeof(overlay_t), 1);
+
+  ov->screen_num = viewport->screen_num;
+  ov->argb = overlay_wants_argb(viewport, &vinfo);
+  if (ov->argb) {
+    visual = vinfo.visual;
+    ov->depth = vinfo.depth;
+    ov->colormap = XCreateColormap(dpy, viewport->root, visual, AllocNone);
+    winattr.colormap = ov->colormap;
+    winattr.border_pixel = 0;
+    ov->zone = XCreateWindow(dpy, viewport->root, viewport->x, viewport->y,
+                             viewport->w, viewport->h, 0, ov->depth,
+                             InputOutput, visual,
+                             CWColormap | CWBorderPixel, &winattr);
+
+    /* Clicks go through to whatever is below, without punching holes at
+     * the pointer */
+    XShapeCombineRectangles(dpy, ov->zone, ShapeInput, 0, 0, NULL, 0,
+                            ShapeSet, Unsorted);
+  } else {
+    ov->depth = viewport->screen->root_depth;
+    ov->zone = XCreateSimpleWindow(dpy, viewport->root, viewport->x,
+                                   viewport->y, viewport->w, viewport->h,
+                                   0, 0, 0);
+  }
+  xdo_set_window_class(xdo, ov->zone, "keynav", "keynav");
+  ov->canvas_gc = XCreateGC(dpy, ov->zone, 0, NULL);
+
+  ov->canvas = XCreatePixmap(dpy, ov->zone, viewport->w, viewport->h,
+                             ov->depth);
+  ov->front = ov->canvas;
+  ov->canvas_surface = cairo_xlib_surface_create(dpy, ov->canvas, visual,
+                                                 viewport->w, viewport->h);
+  ov->canvas_cairo = cairo_create(ov->canvas_surface);
+  cairo_set_antialias(ov->canvas_cairo, CAIRO_ANTIALIAS_NONE);
+  cairo_set_line_cap(ov->canvas_cairo, CAIRO_LINE_CAP_SQUARE);
+
+  if (!ov->argb) {
+    ov->shape = XCreatePixmap(dpy, ov->zone, viewport->w, viewport->h, 1);
+    ov->shape_surface = cairo_xlib_surface_create_for_bitmap(dpy, ov->shape,
+                                                             viewport->screen,
+                                                             viewport->w,
+                                                             viewport->h);
+    ov->shape_cairo = cairo_create(ov->shape_surface);
+    cairo_set_line_width(ov->shape_cairo, wininfo.border_thickness);
+    cairo_set_antialias(ov->shape_cairo, CAIRO_ANTIALIAS_NONE);
+    cairo_set_line_cap(ov->shape_cairo, CAIRO_LINE_CAP_SQUARE);
+    /* A new pixmap holds garbage; the first mask clears all of it */
+    ov->shape_mask_w = viewport->w;
+    ov->shape_mask_h = viewport->h;
+  }
+
+  /* Tell the window manager not to manage us. With no background, the
+   * server leaves resized or exposed areas alone until we copy a frame in,
+   * instead of flashing them in the background color. */
+  winattr.override_redirect = 1;
+  winattr.background_pixmap = None;
+  XChangeWindowAttributes(dpy, ov->zone, CWOverrideRedirect | CWBackPixmap,
+                          &winattr);
+
+  XSelectInput(dpy, ov->zone, StructureNotifyMask | ExposureMask
+               | PointerMotionMask | LeaveWindowMask );
+  return ov;
+}
+
+void overlay_free(overlay_t *ov) {
+  frame_cache_clear(ov);
+  free(ov->shape_rects);
+  if (ov->shape_cairo != NULL) {
+    cairo_destroy(ov->shape_cairo);
+    cairo_surface_destroy(ov->shape_surface);
+    XFreePixmap(dpy, ov->shape);
+  }
+  cairo_destroy(ov->canvas_cairo);
+  cairo_surface_destroy(ov->canvas_surface);
+  XFreePixmap(dpy, ov->canvas);
+  XFreeGC(dpy, ov->canvas_gc);
+  XDestroyWindow(dpy, ov->zone);
+  if (ov->colormap != None)
+    XFreeColormap(dpy, ov->colormap);
+  free(ov);
+}
+
+/* In persistent-overlay mode, build an unmapped overlay for every viewport
+ * ahead of time so 'start' only has to configure and map a window. */
+void overlays_prepare() {
+  int i;
+
+  if (!persistent_overlay) {
+    overlays_free();
+    return;
+  }
+
+  for (i = 0; i < nviewports; i++) {
+    if (viewports[i].overlay == NULL) {
+      viewports[i].overlay = overlay_new(&(viewports[i]));
+      viewports[i].overlay->persistent = 1;
+    }
+    label_atlas_get(viewports[i].screen_num);
+  }
+}
+
+/* Build the prebuilt overlays again, after a setting that decides what
+ * kind of window they are changed */
+void overlays_rebuild() {
+  overlays_free();
+  overlays_prepare();
+}
+
+/* Release the prebuilt overlays. One that is on screen right now is
+ * handed over to cmd_end, which frees it when keynav deactivates. */
+void overlays_free() {
+  int i;
+
+  for (i = 0; i < nviewports; i++) {
+    overlay_t *ov = viewports[i].overlay;
+    if (ov == NULL)
+      continue;
+
+    viewports[i].overlay = NULL;
+    if (ov == overlay) {
+      ov->persistent = 0;
+    } else {
+      overlay_free(ov);
+    }
+  }
+}
+
+void cmd_start(const cmdarg_t *arg) {
+  int screen;
+
+  if (!ISACTIVE)
+    start_time_us = now_us();
+
+  screen = query_current_screen();
+  wininfo.curviewport = (screen >= 0) ? screen : 0;
+
+  appstate.grid_nav_node = 0;
+
+  wininfo.x = viewports[wininfo.curviewport].x;
+  wininfo.y = viewports[wininfo.curviewport].y;
+  wininfo.w = viewports[wininfo.curviewport].w;
+  wininfo.h = viewports[wininfo.curviewport].h;
+
+  /* Without the grab we can't activate; program_run queues the rest of
+   * the program until grab_retry gets it. */
+  if (!grab_keyboard() && !ISACTIVE)
+    return;
 
   /* Default start with 4 cells, 2x2 */
   wininfo.grid_rows = 2;
@@ -944,52 +2431,25 @@ void cmd_start(char *args) {
   if (ISACTIVE)
     return;
 
-  int depth;
-
   appstate.active = True;
   appstate.need_draw = 1;
   appstate.need_moveresize = 1;
 
-  if (zone == 0) { /* Create our window for the first time */
+  if (overlay == NULL) { /* Set up our window */
     viewport_t *viewport = &(viewports[wininfo.curviewport]);
 
-    depth = viewports[wininfo.curviewport].screen->root_depth;
-    wininfo_history_cursor = 0;
-
-    zone = XCreateSimpleWindow(dpy, viewport->root,
-                               wininfo.x, wininfo.y, wininfo.w, wininfo.h, 0, 0, 0);
-    xdo_set_window_class(xdo, zone, "keynav", "keynav");
-    canvas_gc = XCreateGC(dpy, zone, 0, NULL);
-
-    canvas = XCreatePixmap(dpy, zone, viewport->w, viewport->h,
-                           viewport->screen->root_depth);
-    canvas_surface = cairo_xlib_surface_create(dpy, canvas,
-                                               viewport->screen->root_visual,
-                                               viewport->w, viewport->h);
-    canvas_cairo = cairo_create(canvas_surface);
-    cairo_set_antialias(canvas_cairo, CAIRO_ANTIALIAS_NONE);
-    cairo_set_line_cap(canvas_cairo, CAIRO_LINE_CAP_SQUARE);
-
-    shape = XCreatePixmap(dpy, zone, viewport->w, viewport->h, 1);
-    shape_surface = cairo_xlib_surface_create_for_bitmap(dpy, shape,
-                                                         viewport->screen,
-                                                         viewport->w,
-                                                         viewport->h);
-    shape_cairo = cairo_create(shape_surface);
-    cairo_set_line_width(shape_cairo, wininfo.border_thickness);
-    cairo_set_antialias(canvas_cairo, CAIRO_ANTIALIAS_NONE);
-    cairo_set_line_cap(shape_cairo, CAIRO_LINE_CAP_SQUARE);
-
-    /* Tell the window manager not to manage us */
-    winattr.override_redirect = 1;
-    XChangeWindowAttributes(dpy, zone, CWOverrideRedirect, &winattr);
-
-    XSelectInput(dpy, zone, StructureNotifyMask | ExposureMask
-                 | PointerMotionMask | LeaveWindowMask );
-  } /* if zone == 0 */
-}
-
-void cmd_end(char *args) {
+    history_clear();
+
+    if (viewport->overlay != NULL) {
+      overlay = viewport->overlay;
+    } else {
+      overlay = overlay_new(viewport);
+    }
+  } /* if overlay == NULL */
+  timing_record(TIMING_START, start_time_us);
+}
+
+void cmd_end(const cmdarg_t *arg) {
   if (!ISACTIVE)
     return;
 
@@ -1003,59 +2463,51 @@ void cmd_end(char *args) {
   }
 
   appstate.active = False;
+  start_time_us = 0;
+  keypress_time_us = 0;
 
-  //XDestroyWindow(dpy, zone);
-  XUnmapWindow(dpy, zone);
-  cairo_destroy(shape_cairo);
-  cairo_surface_destroy(shape_surface);
-  cairo_destroy(canvas_cairo);
-  cairo_surface_destroy(canvas_surface);
-  XFreePixmap(dpy, shape);
-  XFreePixmap(dpy, canvas);
-  XFreeGC(dpy, canvas_gc);
-  XDestroyWindow(dpy, zone);
+  XUnmapWindow(dpy, overlay->zone);
+  overlay->mapped = 0;
+  if (!overlay->persistent) {
+    overlay_free(overlay);
+  }
   XUngrabKeyboard(dpy, CurrentTime);
 
-  zone = 0;
+  overlay = NULL;
 }
 
-void cmd_toggle_start(char *args) {
+void cmd_toggle_start(const cmdarg_t *arg) {
   if (ISACTIVE) {
-    cmd_end(args);
+    cmd_end(arg);
   } else {
-    cmd_start(args);
+    cmd_start(arg);
   }
 }
 
-void cmd_history_back(char *args) {
+void cmd_history_back(const cmdarg_t *arg) {
   if (!ISACTIVE)
     return;
 
   restore_history_point(1);
 }
 
-void cmd_loadconfig(char *args) {
-  // Trim leading and trailing quotes if they exist
-  if (*args == '"') {
-    args++;
-    *(args + strlen(args) - 1) = '\0';
-  }
+void cmd_history_forward(const cmdarg_t *arg) {
+  if (!ISACTIVE)
+    return;
 
-  parse_config_file(args);
+  restore_history_point(-1);
 }
 
-void cmd_shell(char *args) {
-  // Trim leading and trailing quotes if they exist
-  if (*args == '"') {
-    args++;
-    *(args + strlen(args) - 1) = '\0';
-  }
+void cmd_loadconfig(const cmdarg_t *arg) {
+  parse_config_file(arg->str);
+}
 
+void cmd_shell(const cmdarg_t *arg) {
   if (fork() == 0) { /* child */
     int ret;
     char *const shell = "/bin/sh";
-    char *const argv[4] = { shell, "-c", args, NULL };
-    //printf("Exec: %s\n", args);
+    char *const argv[4] = { shell, "-c", arg->str, NULL };
+    //printf("Exec: %s\n", arg->str);
     //printf("Shell: %s\n", shell);
     ret = execvp(shell, argv);
     perror("execve");
@@ -1063,81 +2515,75 @@ void cmd_shell(char *args) {
   }
 }
 
-void cmd_quit(char *args) {
+void cmd_quit(const cmdarg_t *arg) {
   exit(0);
 }
 
-void cmd_restart(char *args) {
+void cmd_restart(const cmdarg_t *arg) {
   restart();
 }
 
-void cmd_cut_up(char *args) {
+void cmd_cut_up(const cmdarg_t *arg) {
   if (!ISACTIVE)
     return;
-  wininfo.h = percent_of(wininfo.h, args, .5);
+  wininfo.h = percent_of(wininfo.h, arg, .5);
 }
 
-void cmd_cut_down(char *args) {
+void cmd_cut_down(const cmdarg_t *arg) {
   if (!ISACTIVE)
     return;
 
   int orig = wininfo.h;
-  wininfo.h = percent_of(wininfo.h, args, .5);
+  wininfo.h = percent_of(wininfo.h, arg, .5);
   wininfo.y += orig - wininfo.h;
 }
 
-void cmd_cut_left(char *args) {
+void cmd_cut_left(const cmdarg_t *arg) {
   if (!ISACTIVE)
     return;
-  wininfo.w = percent_of(wininfo.w, args, .5);
+  wininfo.w = percent_of(wininfo.w, arg, .5);
 }
 
-void cmd_cut_right(char *args) {
+void cmd_cut_right(const cmdarg_t *arg) {
   int orig = wininfo.w;
   if (!ISACTIVE)
     return;
-  wininfo.w = percent_of(wininfo.w, args, .5);
+  wininfo.w = percent_of(wininfo.w, arg, .5);
   wininfo.x += orig - wininfo.w;
 }
 
-void cmd_move_up(char *args) {
+void cmd_move_up(const cmdarg_t *arg) {
   if (!ISACTIVE)
     return;
-  wininfo.y -= percent_of(wininfo.h, args, 1);
+  wininfo.y -= percent_of(wininfo.h, arg, 1);
 }
 
-void cmd_move_down(char *args) {
+void cmd_move_down(const cmdarg_t *arg) {
   if (!ISACTIVE)
     return;
-  wininfo.y += percent_of(wininfo.h, args, 1);
+  wininfo.y += percent_of(wininfo.h, arg, 1);
 }
 
-void cmd_move_left(char *args) {
+void cmd_move_left(const cmdarg_t *arg) {
   if (!ISACTIVE)
     return;
-  wininfo.x -= percent_of(wininfo.w, args, 1);
+  wininfo.x -= percent_of(wininfo.w, arg, 1);
 }
 
-void cmd_move_right(char *args) {
+void cmd_move_right(const cmdarg_t *arg) {
   if (!ISACTIVE)
     return;
-  wininfo.x += percent_of(wininfo.w, args, 1);
+  wininfo.x += percent_of(wininfo.w, arg, 1);
 }
 
-void cmd_cursorzoom(char *args) {
-  int xradius = 0, yradius = 0, width = 0, height = 0;
+void cmd_cursorzoom(const cmdarg_t *arg) {
+  int width, height;
   int xloc, yloc;
   if (!ISACTIVE)
     return;
 
-  int count = sscanf(args, "%d %d", &width, &height);
-  if (count == 0) {
-    fprintf(stderr,
-            "Invalid usage of 'cursorzoom' (expected at least 1 argument)\n");
-  } else if (count == 1) {
-    /* If only one argument, assume we want a square. */
-    height = width;
-  }
+  width = arg->num[0];
+  height = arg->num[1];
 
   xdo_get_mouse_location(xdo, &xloc, &yloc, NULL);
 
@@ -1147,7 +2593,7 @@ void cmd_cursorzoom(char *args) {
   wininfo.h = height;
 }
 
-void cmd_windowzoom(char *args) {
+void cmd_windowzoom(const cmdarg_t *arg) {
   Window curwin;
   Window rootwin;
   Window dummy_win;
@@ -1168,98 +2614,194 @@ void cmd_windowzoom(char *args) {
   }
 }
 
-void cmd_warp(char *args) {
+/* Pointer and key input. With XTest, warps, clicks and drag modifiers
+ * are queued as fake input on our own connection and go out with the
+ * next flush, so "warp,click 1,end" reaches the server as one batch and
+ * the server applies it in order; nothing waits for a round trip. Each
+ * event after the first can be held back input-delay milliseconds by
+ * the server. Without XTest, or with 'set input-backend xdo', libxdo
+ * does the work and waits for each step. */
+static int have_xtest = 0;
+
+static int input_use_xtest() {
+  if (!have_xtest)
+    return False;
+  return input_backend == NULL || strcmp(input_backend, "xdo");
+}
+
+/* Called when input-backend is set */
+void input_backend_changed() {
+  if (input_backend != NULL && strcmp(input_backend, "xtest")
+      && strcmp(input_backend, "xdo")) {
+    fprintf(stderr, "Unknown input-backend '%s', expected xtest or xdo\n",
+            input_backend);
+    free(input_backend);
+    input_backend = NULL;
+  }
+  if (input_backend != NULL && !strcmp(input_backend, "xtest")
+      && !have_xtest) {
+    fprintf(stderr, "The X server has no XTest extension; using xdo\n");
+  }
+}
+
+static void input_warp(int x, int y, int screen_num) {
+  if (input_use_xtest()) {
+    XTestFakeMotionEvent(dpy, screen_num, x, y, CurrentTime);
+  } else {
+    xdo_move_mouse(xdo, x, y, screen_num);
+    xdo_wait_for_mouse_move_to(xdo, x, y);
+  }
+}
+
+static void input_button(int button, int press) {
+  if (input_use_xtest()) {
+    XTestFakeButtonEvent(dpy, button, press, input_delay);
+  } else if (press) {
+    xdo_mouse_down(xdo, CURRENTWINDOW, button);
+  } else {
+    xdo_mouse_up(xdo, CURRENTWINDOW, button);
+  }
+}
+
+/* Press or release each key of a "ctrl+shift" style sequence. Keys are
+ * released in the reverse of the order they were pressed. */
+static void input_keys(const char *keyseq, int press) {
+  const char **symbol_map = xdo_get_symbol_map();
+  KeyCode keycodes[16];
+  int nkeys = 0;
+  char *dup, *strptr, *tok, *tokctx;
+  int i;
+
+  if (keyseq == NULL || *keyseq == '\0')
+    return;
+
+  if (!input_use_xtest()) {
+    if (press)
+      xdo_send_keysequence_window_down(xdo, 0, keyseq, 12000);
+    else
+      xdo_send_keysequence_window_up(xdo, 0, keyseq, 12000);
+    return;
+  }
+
+  strptr = dup = strdup(keyseq);
+  while (nkeys < sizeof(keycodes) / sizeof(*keycodes)
+         && (tok = strtok_r(strptr, "+", &tokctx)) != NULL) {
+    const char *name = tok;
+    KeyCode keycode;
+    int j;
+
+    strptr = NULL;
+    for (j = 0; symbol_map[j] != NULL; j += 2) {
+      if (!strcasecmp(name, symbol_map[j]))
+        name = symbol_map[j + 1];
+    }
+    keycode = XKeysymToKeycode(dpy, XStringToKeysym(name));
+    if (keycode == 0) {
+      fprintf(stderr, "Unable to lookup keycode for %s\n", tok);
+      continue;
+    }
+    keycodes[nkeys++] = keycode;
+  }
+  free(dup);
+
+  for (i = 0; i < nkeys; i++) {
+    XTestFakeKeyEvent(dpy, keycodes[press ? i : nkeys - 1 - i], press,
+                      input_delay);
+  }
+}
+
+static void input_wiggle() {
+  if (input_use_xtest()) {
+    XTestFakeRelativeMotionEvent(dpy, 1, 0, input_delay);
+    XTestFakeRelativeMotionEvent(dpy, -1, 0, input_delay);
+  } else {
+    xdo_move_mouse_relative(xdo, 1, 0);
+    xdo_move_mouse_relative(xdo, -1, 0);
+    XSync(xdo->xdpy, 0);
+  }
+}
+
+void cmd_warp(const cmdarg_t *arg) {
   if (!ISACTIVE)
     return;
+  long long warp_start_us = now_us();
   int x, y;
   x = wininfo.x + wininfo.w / 2;
   y = wininfo.y + wininfo.h / 2;
 
   if (mouseinfo.x != -1 && mouseinfo.y != -1) {
-    closepixel(dpy, zone, &mouseinfo);
+    closepixel(dpy, overlay->zone, &mouseinfo);
   }
 
   /* Open pixels hould be relative to the window coordinates,
    * not screen coordinates. */
   mouseinfo.x = x - wininfo.x;
   mouseinfo.y = y - wininfo.y;
-  openpixel(dpy, zone, &mouseinfo);
+  openpixel(dpy, overlay->zone, &mouseinfo);
 
-  xdo_move_mouse(xdo, x, y, viewports[wininfo.curviewport].screen_num);
-  xdo_wait_for_mouse_move_to(xdo, x, y);
+  input_warp(x, y, viewports[wininfo.curviewport].screen_num);
 
   /* TODO(sissel): do we need to open again? */
-  openpixel(dpy, zone, &mouseinfo);
+  openpixel(dpy, overlay->zone, &mouseinfo);
+  timing_record(TIMING_WARP, warp_start_us);
 }
 
-void cmd_click(char *args) {
+void cmd_click(const cmdarg_t *arg) {
   if (!ISACTIVE)
     return;
 
-  int button;
-  button = atoi(args);
-  if (button > 0)
-    xdo_click_window(xdo, CURRENTWINDOW, button);
-  else
-    fprintf(stderr, "Negative mouse button is invalid: %d\n", button);
+  if (input_use_xtest()) {
+    input_button(arg->num[0], True);
+    input_button(arg->num[0], False);
+  } else {
+    xdo_click_window(xdo, CURRENTWINDOW, arg->num[0]);
+  }
 }
 
-void cmd_doubleclick(char *args) {
+void cmd_doubleclick(const cmdarg_t *arg) {
   if (!ISACTIVE)
     return;
-  cmd_click(args);
-  cmd_click(args);
+  cmd_click(arg);
+  cmd_click(arg);
 }
 
-void cmd_drag(char *args) {
+void cmd_drag(const cmdarg_t *arg) {
   if (!ISACTIVE)
     return;
 
   int button;
-  if (args == NULL) {
+  if (arg == NULL) {
     button = drag_button;
   } else {
-    int count = sscanf(args, "%d %127s", &button, drag_modkeys);
-    if (count == 0) {
-      button = 1; /* Default to left mouse button */
-      drag_modkeys[0] = '\0';
-    } else if (count == 1) {
-      drag_modkeys[0] = '\0';
-    }
-  }
-
-  if (button <= 0) {
-    fprintf(stderr, "Negative or no mouse button given. Not valid. Button read was '%d'\n", button);
-    return;
+    button = arg->num[0];
+    snprintf(drag_modkeys, sizeof(drag_modkeys), "%s", arg->str);
   }
 
   drag_button = button;
 
   if (ISDRAGGING) { /* End dragging */
     appstate.dragging = False;
-    xdo_mouse_up(xdo, CURRENTWINDOW, button);
+    input_button(button, False);
   } else { /* Start dragging */
     cmd_warp(NULL);
     appstate.dragging = True;
-    xdo_send_keysequence_window_down(xdo, 0, drag_modkeys, 12000);
-    xdo_mouse_down(xdo, CURRENTWINDOW, button);
+    input_keys(drag_modkeys, True);
+    input_button(button, True);
 
     /* Sometimes we need to move a little to tell the app we're dragging */
     /* TODO(sissel): Make this a 'mousewiggle' command */
-    xdo_move_mouse_relative(xdo, 1, 0);
-    xdo_move_mouse_relative(xdo, -1, 0);
-    XSync(xdo->xdpy, 0);
-    xdo_send_keysequence_window_up(xdo, 0, drag_modkeys, 12000);
+    input_wiggle();
+    input_keys(drag_modkeys, False);
   }
 }
 
-void cmd_grid_nav(char *args) {
+void cmd_grid_nav(const cmdarg_t *arg) {
 
-  if (!strcmp("on", args)) {
+  if (arg->num[0] == GRID_NAV_ON) {
     appstate.grid_label = GRID_LABEL_AA;
-  } else if (!strcmp("off", args)) {
+  } else if (arg->num[0] == GRID_NAV_OFF) {
     appstate.grid_label = GRID_LABEL_NONE;
-  } else if (!strcmp("toggle", args)) {
+  } else if (arg->num[0] == GRID_NAV_TOGGLE) {
     if (appstate.grid_label == GRID_LABEL_NONE) {
       appstate.grid_label = GRID_LABEL_AA;
     } else {
@@ -1272,40 +2814,26 @@ void cmd_grid_nav(char *args) {
     appstate.grid_nav = 0;
   } else {
     appstate.grid_nav = 1;
-    appstate.grid_nav_state = GRID_NAV_ROW;
   }
+  appstate.grid_nav_node = 0;
 
   appstate.need_draw = 1;
 }
 
-void cmd_grid(char *args) {
-  int grid_cols, grid_rows;
-
-  // Try to parse 'NxN' where N is a number.
-  if (sscanf(args, "%dx%d", &grid_cols, &grid_rows) <= 0) {
-    // Otherwise, try parsing a number.
-    grid_cols = grid_rows = atoi(args);
-  }
-
-  if (grid_cols <= 0 || grid_rows <= 0) {
-    fprintf(stderr, "Invalid grid segmentation: %dx%d\n", grid_cols, grid_rows);
-    fprintf(stderr, "Grid x and y must both be greater than 0.\n");
-    return;
-  }
-
-  wininfo.grid_cols = grid_cols;
-  wininfo.grid_rows = grid_rows;
+void cmd_grid(const cmdarg_t *arg) {
+  wininfo.grid_cols = arg->num[0];
+  wininfo.grid_rows = arg->num[1];
 }
 
-void cmd_cell_select(char *args) {
+void cmd_cell_select(const cmdarg_t *arg) {
   int row, col, z;
-  int cell_width, cell_height;
   row = col = z = 0;
 
-  // Try to parse 'NxM' where N and M are a number.
-  if (sscanf(args, "%dx%d", &col, &row) < 2) {
-    // Otherwise, try parsing just number.
-    z = atoi(args);
+  if (arg->count == 2) {
+    col = arg->num[0];
+    row = arg->num[1];
+  } else {
+    z = arg->num[0];
   }
 
   // if z > 0, then this means we said "cell-select N"
@@ -1346,29 +2874,155 @@ void cell_select(int col, int row) {
   wininfo.y = wininfo.y + (wininfo.h * (row));
 }
 
-void cmd_daemonize(char *args) {
+void cmd_set(const cmdarg_t *arg) {
+  option_t *option = &(options[arg->num[0]]);
+
+  if (option->type == OPTION_STRING) {
+    char **value = option->value;
+    free(*value);
+    *value = strdup(arg->str);
+  } else {
+    *((int *)option->value) = arg->num[1];
+  }
+  if (option->changed != NULL) {
+    option->changed();
+  }
+}
+
+/* The smallest bucket bound that covers the given fraction of samples */
+long long timing_percentile(const timing_t *t, double fraction) {
+  unsigned long rank = (unsigned long)(fraction * t->count);
+  unsigned long seen = 0;
+  int i;
+
+  if (rank >= t->count)
+    rank = t->count - 1;
+  for (i = 0; i < TIMING_BUCKETS - 1; i++) {
+    seen += t->buckets[i];
+    if (seen > rank)
+      break;
+  }
+  /* Bucket i holds samples below 2^i; don't claim more than we saw */
+  return MIN(1LL << i, t->max_us);
+}
+
+void stats_write(FILE *fp) {
+  int i;
+
+  for (i = 0; i < NTIMINGS; i++) {
+    timing_t *t = &(timings[i]);
+    if (t->count == 0) {
+      fprintf(fp, "%s: no samples\n", t->name);
+      continue;
+    }
+    fprintf(fp, "%s: count=%lu avg=%lldus min=%lldus p50=%lldus p90=%lldus "
+            "p99=%lldus max=%lldus\n",
+            t->name, t->count, t->total_us / (long long)t->count, t->min_us,
+            timing_percentile(t, 0.50), timing_percentile(t, 0.90),
+            timing_percentile(t, 0.99), t->max_us);
+  }
+  fprintf(fp, "frame-cache: hits=%lu misses=%lu\n",
+          frame_cache_hits, frame_cache_misses);
+  fprintf(fp, "shape: set=%lu mask=%lu diff=%lu offset=%lu unchanged=%lu\n",
+          shape_sets, shape_masks, shape_diffs, shape_offsets,
+          shape_unchanged);
+  fprintf(fp, "speculate: drawn=%lu used=%lu\n",
+          speculations_drawn, speculations_used);
+}
+
+void stats_reset() {
+  int i;
+
+  for (i = 0; i < NTIMINGS; i++) {
+    char *name = timings[i].name;
+    memset(&(timings[i]), 0, sizeof(timing_t));
+    timings[i].name = name;
+  }
+  frame_cache_hits = frame_cache_misses = 0;
+  shape_sets = shape_masks = shape_diffs = shape_offsets = 0;
+  shape_unchanged = 0;
+  speculations_drawn = speculations_used = 0;
+}
+
+/* 'stats' prints to stderr, 'stats reset' zeroes everything, and
+ * 'stats <file>' appends to a file */
+void cmd_stats(const cmdarg_t *arg) {
+  FILE *fp;
+
+  if (arg->str == NULL || *arg->str == '\0') {
+    stats_write(stderr);
+  } else if (!strcmp(arg->str, "reset")) {
+    stats_reset();
+  } else {
+    fp = fopen(arg->str, "a");
+    if (fp == NULL) {
+      fprintf(stderr, "Failed to open '%s' for stats: %s\n", arg->str,
+              strerror(errno));
+      return;
+    }
+    stats_write(fp);
+    fclose(fp);
+  }
+}
+
+long long now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void timing_record(int which, long long start_us) {
+  timing_t *t = &(timings[which]);
+  long long elapsed = now_us() - start_us;
+  int bucket = 0;
+
+  if (elapsed < 0)
+    elapsed = 0;
+  while (bucket < TIMING_BUCKETS - 1 && (1LL << bucket) <= elapsed)
+    bucket++;
+  t->buckets[bucket]++;
+
+  if (t->count == 0 || elapsed < t->min_us)
+    t->min_us = elapsed;
+  if (elapsed > t->max_us)
+    t->max_us = elapsed;
+  t->total_us += elapsed;
+  t->count++;
+}
+
+void cmd_daemonize(const cmdarg_t *arg) {
   if (!is_daemon) {
     daemonize = 1;
   }
 }
 
-void cmd_playback(char *args) {
+void cmd_playback(const cmdarg_t *arg) {
   appstate.playback = 1;
 }
 
-void cmd_record(char *args) {
+void cmd_record(const cmdarg_t *arg) {
   char *filename;
   if (!ISACTIVE)
     return;
 
-  if (appstate.recording != record_off) {
+  if (appstate.recording == record_getkey) {
+    /* Stopped before a key was chosen; nothing to keep */
+    appstate.recording = record_off;
+    recording_free(active_recording);
+    active_recording = NULL;
+  } else if (appstate.recording != record_off) {
     appstate.recording = record_off;
-    g_ptr_array_add(recordings, (gpointer) active_recording);
 
     /* Save to file */
     if (recordings_filename != NULL) {
-      recordings_save(recordings_filename);
+      recordings_append(recordings_filename, active_recording);
+    }
+    if (active_recording->commands->len > 0) {
+      recording_store(active_recording);
+    } else {
+      recording_free(active_recording);
     }
+    active_recording = NULL;
   } else {
     active_recording = calloc(sizeof(recording_t), 1);
     active_recording->commands = g_ptr_array_new();
@@ -1376,6 +3030,9 @@ void cmd_record(char *args) {
   }
 }
 
+/* Apply changes to wininfo: keep the window on screen and schedule a frame
+ * to show it. Drawing is left to frame_commit so that everything done for
+ * one batch of events produces a single frame. */
 void update() {
   if (!ISACTIVE)
     return;
@@ -1387,7 +3044,17 @@ void update() {
     return;
   }
 
-  wininfo_t *previous = &(wininfo_history[wininfo_history_cursor - 1]);
+  appstate.need_frame = 1;
+}
+
+/* Bring the keynav window up to date with wininfo. The main loop calls this
+ * once there are no more events waiting. */
+void frame_commit() {
+  appstate.need_frame = 0;
+  if (!ISACTIVE)
+    return;
+
+  wininfo_t *previous = &(overlay->shown);
   //printf("window: %d,%d @ %d,%d\n", wininfo.w, wininfo.h, wininfo.x, wininfo.y);
   //printf("previous: %d,%d @ %d,%d\n", previous->w, previous->h, previous->x, previous->y);
   int draw = 0, move = 0, resize = 0, clip = 0;
@@ -1401,6 +3068,13 @@ void update() {
     resize = 1;
   }
 
+  if (previous->grid_rows != wininfo.grid_rows
+      || previous->grid_cols != wininfo.grid_cols
+      || previous->border_thickness != wininfo.border_thickness) {
+    clip = 1;
+    draw = 1;
+  }
+
   if (appstate.need_draw) {
     clip = 1;
     draw = 1;
@@ -1415,135 +3089,629 @@ void update() {
 
   //printf("move: %d, clip: %d, draw: %d, resize: %d\n", move, clip, draw, resize);
 
-  //clip = 0;
-  if (((clip || draw) + (move || resize)) > 1) {
-    /* more than one action to perform, unmap to hide move/draws
-     * to reduce flickering */
-    XUnmapWindow(dpy, zone);
+  if (!(clip || draw || move || resize) && overlay->mapped) {
+    keypress_time_us = 0;
+    return; /* Nothing changed */
   }
 
-  if (clip || draw) {
-    updategrid(zone, &wininfo, clip, draw);
-
-    if (appstate.grid_label != GRID_LABEL_NONE) {
-      updategridtext(zone, &wininfo, clip, draw);
-    }
+  /* The window stays mapped. The new frame is drawn off screen first, then
+   * the shape, geometry and contents go out together in one flush. The
+   * window has no background, so nothing is cleared in between. */
+  Pixmap back = None;
+  const XRectangle *rects = NULL;
+  int nrects = 0;
 
-    if (draw) {
-      XCopyArea(dpy, canvas, zone, canvas_gc, 0, 0, wininfo.w, wininfo.h, 0, 0);
-    }
-    if (clip) {
-      XShapeCombineRectangles(dpy, zone, ShapeBounding, 0, 0,
-                              clip_rectangles, nclip_rectangles, ShapeSet, 0);
-    }
+  if (clip || draw) {
+    back = draw_frame(&rects, &nrects);
+    if (nspeculations > 0)
+      speculate_next = 0;
   }
 
+  if (back != None && !overlay->argb) {
+    long long phase_start_us = now_us();
+    shape_apply(overlay, rects, nrects);
+    timing_record(TIMING_SHAPE, phase_start_us);
+  }
 
   if (resize && move) {
     //printf("=> %ld: %dx%d @ %d,%d\n", zone, wininfo.w, wininfo.h, wininfo.x,
            //wininfo.y);
-    XMoveResizeWindow(dpy, zone, wininfo.x, wininfo.y, wininfo.w, wininfo.h);
+    XMoveResizeWindow(dpy, overlay->zone, wininfo.x, wininfo.y, wininfo.w, wininfo.h);
 
     /* Under Gnome3/GnomeShell, it seems to ignore this move+resize request
-     * unless we sync and sleep here. Sigh. Gnome is retarded. */
-    XSync(dpy, 0);
-    usleep(5000);
+     * unless we sync and sleep here. */
+    if (gnome_moveresize_sync) {
+      XSync(dpy, 0);
+      usleep(5000);
+    }
   } else if (resize) {
-    XResizeWindow(dpy, zone, wininfo.w, wininfo.h);
+    XResizeWindow(dpy, overlay->zone, wininfo.w, wininfo.h);
   } else if (move) {
-    XMoveWindow(dpy, zone, wininfo.x, wininfo.y);
+    XMoveWindow(dpy, overlay->zone, wininfo.x, wininfo.y);
+  }
+
+  /* Map before copying: an unmapped window would drop the contents. Once
+   * it is up (from the first frame after 'start' to 'end'), leave it be;
+   * a compositor restacks on every map request. */
+  if (!overlay->mapped) {
+    XMapRaised(dpy, overlay->zone);
+    overlay->mapped = 1;
   }
 
-  XMapRaised(dpy, zone);
+  if (back != None) {
+    XCopyArea(dpy, back, overlay->zone, overlay->canvas_gc,
+              0, 0, wininfo.w, wininfo.h, 0, 0);
+  }
+  memcpy(&(overlay->shown), &wininfo, sizeof(wininfo_t));
+  XFlush(dpy);
+
+  if (start_time_us != 0 || keypress_time_us != 0) {
+    if (start_time_us != 0)
+      timing_record(TIMING_START_TO_FRAME, start_time_us);
+    if (keypress_time_us != 0)
+      timing_record(TIMING_KEYPRESS_TO_FRAME, keypress_time_us);
+    start_time_us = 0;
+    keypress_time_us = 0;
+  }
 }
 
-void correct_overflow() {
-  /* If the window is outside the boundaries of the screen, bump it back
-   * or, if possible, move it to the next screen */
+/* Get the frame for the current wininfo ready without touching the window:
+ * a cached one if this geometry was drawn before, otherwise a fresh render.
+ * Returns the pixmap holding it and sets rects to its shape. */
+Pixmap draw_frame(const XRectangle **rects, int *nrects) {
+  frame_key_t key;
+  frame_t *frame;
+  long long phase_start_us;
+
+  frame_key_init(&key, &wininfo);
+  frame = frame_cache_lookup(overlay, &key);
+  if (frame != NULL) {
+    frame_cache_hits++;
+    if (frame->speculative) {
+      speculations_used++;
+      frame->speculative = 0;
+    }
+    overlay->front = frame->pixmap;
+    *rects = frame->rectangles;
+    *nrects = frame->nrectangles;
+    return frame->pixmap;
+  }
+
+  frame_cache_misses++;
+  phase_start_us = now_us();
+  overlay_render(overlay, &wininfo);
+  timing_record(TIMING_RENDER, phase_start_us);
+
+  /* Expose repaints from the cached copy, leaving the canvas free for
+   * speculative drawing */
+  overlay->front = overlay->canvas;
+  frame = frame_cache_store(overlay, &key);
+  if (frame != NULL) {
+    overlay->front = frame->pixmap;
+  }
+  *rects = clip_rectangles;
+  *nrects = nclip_rectangles;
+  return overlay->canvas;
+}
+
+/* Render the grid for info into the overlay's canvas. An ARGB overlay has
+ * no window shape, so everything the shape would have cut away is made
+ * transparent instead. */
+void overlay_render(overlay_t *ov, wininfo_t *info) {
+  render_grid(ov->canvas_cairo,
+              (appstate.grid_label != GRID_LABEL_NONE
+               ? label_atlas_get(ov->screen_num) : NULL),
+              info);
+  if (!ov->argb)
+    return;
 
-  if (wininfo.x < viewports[wininfo.curviewport].x)
-    viewport_left();
-  if (wininfo.x + wininfo.w >
-      viewports[wininfo.curviewport].x + viewports[wininfo.curviewport].w)
-    viewport_right();
+  cairo_rectangle_int_t full = { 0, 0, info->w, info->h };
+  cairo_rectangle_int_t *shown = malloc((nclip_rectangles + 1)
+                                        * sizeof(cairo_rectangle_int_t));
+  cairo_region_t *outside, *kept;
+  int i, n = 0;
 
-  /* Fix positioning if we went out of bounds (off the screen) */
-  if (wininfo.x < 0) {
-    wininfo.x = 0;
+  for (i = 0; i < nclip_rectangles; i++) {
+    if (clip_rectangles[i].width == 0 || clip_rectangles[i].height == 0)
+      continue;
+    shown[n].x = clip_rectangles[i].x;
+    shown[n].y = clip_rectangles[i].y;
+    shown[n].width = clip_rectangles[i].width;
+    shown[n].height = clip_rectangles[i].height;
+    n++;
+  }
+  kept = cairo_region_create_rectangles(shown, n);
+  outside = cairo_region_create_rectangle(&full);
+  cairo_region_subtract(outside, kept);
+
+  cairo_save(ov->canvas_cairo);
+  cairo_set_operator(ov->canvas_cairo, CAIRO_OPERATOR_CLEAR);
+  n = cairo_region_num_rectangles(outside);
+  for (i = 0; i < n; i++) {
+    cairo_region_get_rectangle(outside, i, &full);
+    cairo_rectangle(ov->canvas_cairo, full.x, full.y, full.width, full.height);
   }
-  if (wininfo.x + wininfo.w >
-      viewports[wininfo.curviewport].x + viewports[wininfo.curviewport].w)
-    wininfo.x = viewports[wininfo.curviewport].x + viewports[wininfo.curviewport].w - wininfo.w;
+  cairo_fill(ov->canvas_cairo);
+  cairo_restore(ov->canvas_cairo);
 
-  /* XXX: We don't currently understand how to move around if displays are
-   * vertically stacked. */
-  if (wininfo.y < 0)
-    wininfo.y = 0;
-  if (wininfo.y + wininfo.h >
-      viewports[wininfo.curviewport].y + viewports[wininfo.curviewport].h)
-    wininfo.y = viewports[wininfo.curviewport].h - wininfo.h;
+  cairo_region_destroy(outside);
+  cairo_region_destroy(kept);
+  free(shown);
 }
 
-void viewport_right() {
-  int expand_w = 0, expand_h = 0;
+void frame_key_init(frame_key_t *key, const wininfo_t *info) {
+  memset(key, 0, sizeof(frame_key_t));
+  key->w = info->w;
+  key->h = info->h;
+  key->grid_rows = info->grid_rows;
+  key->grid_cols = info->grid_cols;
+  key->border_thickness = info->border_thickness;
+  key->grid_label = appstate.grid_label;
+  key->label_prefix = grid_nav_prefix(info);
+}
 
-  /* Expand if the current window is the size of the current viewport */
-  //printf("right %d] %d,%d vs %d,%d\n", wininfo.curviewport,
-         //wininfo.w, wininfo.h,
-         //viewports[wininfo.curviewport].w, viewports[wininfo.curviewport].h);
-  if (wininfo.curviewport == nviewports - 1)
+/* Resolve the 'speculate' option, a list of keys like "h j k l", into
+ * keycodes and modifiers. Their bindings are looked up when drawing so
+ * later config changes are picked up. */
+void speculate_keys_changed() {
+  char *dup, *tok, *tokctx, *strptr;
+
+  free(speculations);
+  speculations = NULL;
+  nspeculations = 0;
+  speculate_next = -1;
+
+  if (speculate_keys == NULL)
     return;
 
-  if (wininfo.w == viewports[wininfo.curviewport].w)
-    expand_w = 1;
-  if (wininfo.h == viewports[wininfo.curviewport].h) {
-    expand_h = 1;
+  strptr = dup = strdup(speculate_keys);
+  while ((tok = strtok_r(strptr, " ,", &tokctx)) != NULL) {
+    strptr = NULL;
+    if (!strcmp(tok, "off"))
+      continue;
+
+    int keycode = parse_keycode(tok);
+    if (keycode == 0)
+      continue;
+    speculations = realloc(speculations,
+                           (nspeculations + 1) * sizeof(speculation_t));
+    speculations[nspeculations].keycode = keycode;
+    speculations[nspeculations].mods = parse_mods(tok);
+    nspeculations++;
+  }
+  free(dup);
+}
+
+/* Draw the frame one candidate key would produce into the frame cache.
+ * Called while there is no input waiting; returns 1 if there may be more
+ * candidates left to draw. */
+int speculate() {
+  wininfo_t saved;
+  keybinding_t *kbt;
+  frame_key_t key;
+  frame_t *frame;
+  int i;
+
+  if (speculate_next < 0 || !ISACTIVE || ISDRAGGING || frame_cache_size < 2) {
+    speculate_next = -1;
+    return 0;
+  }
+
+  if (speculate_next >= nspeculations) {
+    speculate_next = -1;
+    return 0;
   }
 
-  wininfo.curviewport++;
+  kbt = keybinding_lookup(speculations[speculate_next].keycode,
+                          speculations[speculate_next].mods);
+  speculate_next++;
+  if (kbt == NULL)
+    return 1;
 
-  if ((expand_w) || wininfo.w > viewports[wininfo.curviewport].w) {
-    wininfo.w = viewports[wininfo.curviewport].w;
+  for (i = 0; i < kbt->program->ncommands; i++) {
+    if (!(kbt->program->commands[i].dispatch->flags & CMD_GEOMETRY))
+      return 1;
   }
-  if ((expand_h) || wininfo.h > viewports[wininfo.curviewport].h) {
-    wininfo.h = viewports[wininfo.curviewport].h;
+
+  /* Run the binding against a copy of the window geometry */
+  memcpy(&saved, &wininfo, sizeof(wininfo_t));
+  for (i = 0; i < kbt->program->ncommands; i++) {
+    kbt->program->commands[i].dispatch->func(&(kbt->program->commands[i].arg));
   }
-  wininfo.x = viewports[wininfo.curviewport].x;
+  correct_overflow();
+
+  if (wininfo.w > 1 && wininfo.h > 1 && wininfo.curviewport == saved.curviewport) {
+    frame_key_init(&key, &wininfo);
+    if (frame_cache_lookup(overlay, &key) == NULL) {
+      overlay_render(overlay, &wininfo);
+      frame = frame_cache_store(overlay, &key);
+      if (frame != NULL) {
+        frame->speculative = 1;
+        speculations_drawn++;
+      }
+    }
+  }
+
+  memcpy(&wininfo, &saved, sizeof(wininfo_t));
+  return 1;
 }
 
-void viewport_left() {
+int rect_cmp(const void *a, const void *b) {
+  const XRectangle *ra = a;
+  const XRectangle *rb = b;
+
+  if (ra->y != rb->y)
+    return ra->y - rb->y;
+  if (ra->x != rb->x)
+    return ra->x - rb->x;
+  if (ra->width != rb->width)
+    return ra->width - rb->width;
+  return ra->height - rb->height;
+}
+
+int rect_intersects(const XRectangle *a, const XRectangle *b) {
+  return a->x < b->x + b->width && b->x < a->x + a->width
+         && a->y < b->y + b->height && b->y < a->y + a->height;
+}
+
+/* Set the window shape to the union of rects. Rather than replacing the
+ * whole region every time, send only what changed since the last shape:
+ * subtract rectangles that went away, then add new ones along with any
+ * kept ones the subtraction cut into. A full ShapeSet is used when that
+ * would be no smaller, and with more than shape-mask-threshold rectangles
+ * it is sent as a bitmap instead. */
+void shape_apply(overlay_t *ov, const XRectangle *rects, int nrects) {
+  XRectangle *next;
+  XRectangle *removed, *added;
+  int nnext = 0, nremoved = 0, nadded = 0, nnew;
+  int touched;
+  int i, j;
+
+  /* Sort and drop empty and duplicate rectangles */
+  next = malloc((nrects + 1) * sizeof(XRectangle));
+  for (i = 0; i < nrects; i++) {
+    if (rects[i].width > 0 && rects[i].height > 0)
+      next[nnext++] = rects[i];
+  }
+  qsort(next, nnext, sizeof(XRectangle), rect_cmp);
+  for (i = 1, j = 0; i < nnext; i++) {
+    if (rect_cmp(&(next[j]), &(next[i])) != 0)
+      next[++j] = next[i];
+  }
+  if (nnext > 0)
+    nnext = j + 1;
+
+  if (!ov->shape_valid) {
+    goto full;
+  }
+
+  /* Pixels punched or filled around the pointer since the last shape are
+   * reset along with everything else */
+  touched = (ov->shape_touched.width > 0);
+
+  /* The same shape moved by a constant offset */
+  if (!touched && nnext == ov->nshape_rects && nnext > 0) {
+    int dx = next[0].x - ov->shape_rects[0].x;
+    int dy = next[0].y - ov->shape_rects[0].y;
+    for (i = 0; i < nnext; i++) {
+      if (next[i].x - ov->shape_rects[i].x != dx
+          || next[i].y - ov->shape_rects[i].y != dy
+          || next[i].width != ov->shape_rects[i].width
+          || next[i].height != ov->shape_rects[i].height)
+        break;
+    }
+    if (i == nnext) {
+      if (dx == 0 && dy == 0) {
+        shape_unchanged++;
+      } else {
+        XShapeOffsetShape(dpy, ov->zone, ShapeBounding, dx, dy);
+        shape_offsets++;
+      }
+      goto done;
+    }
+  }
+
+  /* Walk both sorted lists to find what was removed and what was added */
+  removed = malloc((ov->nshape_rects + 1) * sizeof(XRectangle));
+  added = malloc((nnext * 2 + 1) * sizeof(XRectangle));
+  i = j = 0;
+  while (i < ov->nshape_rects || j < nnext) {
+    int cmp;
+    if (i == ov->nshape_rects)
+      cmp = 1;
+    else if (j == nnext)
+      cmp = -1;
+    else
+      cmp = rect_cmp(&(ov->shape_rects[i]), &(next[j]));
+
+    if (cmp < 0) {
+      removed[nremoved++] = ov->shape_rects[i++];
+    } else if (cmp > 0) {
+      added[nadded++] = next[j++];
+    } else {
+      i++;
+      j++;
+    }
+  }
+  if (touched) {
+    removed[nremoved++] = ov->shape_touched;
+  }
+
+  /* Kept rectangles overlapping a removed one have to be added back */
+  nnew = nadded;
+  for (j = 0; j < nnext && nadded < nnext; j++) {
+    if (bsearch(&(next[j]), added, nnew, sizeof(XRectangle), rect_cmp))
+      continue;
+    for (i = 0; i < nremoved; i++) {
+      if (rect_intersects(&(next[j]), &(removed[i]))) {
+        added[nadded++] = next[j];
+        break;
+      }
+    }
+  }
+
+  if (nremoved + nadded >= nnext) {
+    free(removed);
+    free(added);
+    goto full;
+  }
+
+  if (nremoved > 0) {
+    XShapeCombineRectangles(dpy, ov->zone, ShapeBounding, 0, 0,
+                            removed, nremoved, ShapeSubtract, 0);
+  }
+  if (nadded > 0) {
+    XShapeCombineRectangles(dpy, ov->zone, ShapeBounding, 0, 0,
+                            added, nadded, ShapeUnion, 0);
+  }
+  if (nremoved + nadded > 0) {
+    shape_diffs++;
+  } else {
+    shape_unchanged++;
+  }
+  free(removed);
+  free(added);
+  goto done;
+
+full:
+  if (nnext > shape_mask_threshold) {
+    shape_mask_apply(ov, next, nnext);
+    shape_masks++;
+  } else {
+    XShapeCombineRectangles(dpy, ov->zone, ShapeBounding, 0, 0,
+                            next, nnext, ShapeSet, Unsorted);
+    shape_sets++;
+  }
+  ov->shape_valid = 1;
+
+done:
+  free(ov->shape_rects);
+  ov->shape_rects = next;
+  ov->nshape_rects = nnext;
+  memset(&(ov->shape_touched), 0, sizeof(XRectangle));
+}
+
+/* Set the window shape from the shape bitmap with rects filled in. The
+ * server turns a bitmap into a region with one scan, where a long list of
+ * rectangles costs it a sort and a merge; on dense grids that wins. */
+void shape_mask_apply(overlay_t *ov, const XRectangle *rects, int nrects) {
+  cairo_t *cr = ov->shape_cairo;
+  int w = 0, h = 0;
+  int i;
+
+  for (i = 0; i < nrects; i++) {
+    w = MAX(w, rects[i].x + rects[i].width);
+    h = MAX(h, rects[i].y + rects[i].height);
+  }
+
+  /* The whole pixmap is the shape, so clear whatever an earlier, larger
+   * mask left set as well; a later grow would otherwise bring it back */
+  cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+  cairo_rectangle(cr, 0, 0, MAX(w, ov->shape_mask_w),
+                  MAX(h, ov->shape_mask_h));
+  cairo_fill(cr);
+  ov->shape_mask_w = w;
+  ov->shape_mask_h = h;
+
+  cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_rgba(cr, 0, 0, 0, 1);
+  for (i = 0; i < nrects; i++) {
+    cairo_rectangle(cr, rects[i].x, rects[i].y,
+                    rects[i].width, rects[i].height);
+  }
+  cairo_fill(cr);
+  cairo_surface_flush(ov->shape_surface);
+
+  XShapeCombineMask(dpy, ov->zone, ShapeBounding, 0, 0, ov->shape, ShapeSet);
+}
+
+/* Remember that a pixel of the shape was changed outside shape_apply. */
+void shape_touch(overlay_t *ov, const XRectangle *rect) {
+  XRectangle *t = &(ov->shape_touched);
+  int x2, y2;
+
+  if (t->width == 0) {
+    *t = *rect;
+    return;
+  }
+
+  x2 = MAX(t->x + t->width, rect->x + rect->width);
+  y2 = MAX(t->y + t->height, rect->y + rect->height);
+  t->x = MIN(t->x, rect->x);
+  t->y = MIN(t->y, rect->y);
+  t->width = x2 - t->x;
+  t->height = y2 - t->y;
+}
+
+frame_t *frame_cache_lookup(overlay_t *ov, const frame_key_t *key) {
+  static unsigned long tick = 0;
+  int i;
+
+  for (i = 0; i < ov->nframes; i++) {
+    if (!memcmp(&(ov->frames[i].key), key, sizeof(frame_key_t))) {
+      ov->frames[i].last_used = ++tick;
+      return &(ov->frames[i]);
+    }
+  }
+  return NULL;
+}
+
+/* Save what was just drawn on the canvas, evicting the least recently used
+ * frame if the cache is full. The frame on screen is never evicted. */
+frame_t *frame_cache_store(overlay_t *ov, const frame_key_t *key) {
+  frame_t *frame = NULL;
+  int i;
+
+  if (frame_cache_size <= 0)
+    return NULL;
+
+  if (ov->frames == NULL) {
+    ov->frames = calloc(frame_cache_size, sizeof(frame_t));
+  }
+
+  if (ov->nframes < frame_cache_size) {
+    frame = &(ov->frames[ov->nframes]);
+    ov->nframes++;
+  } else {
+    for (i = 0; i < ov->nframes; i++) {
+      if (ov->frames[i].pixmap == ov->front)
+        continue;
+      if (frame == NULL || ov->frames[i].last_used < frame->last_used)
+        frame = &(ov->frames[i]);
+    }
+    if (frame == NULL)
+      return NULL;
+    XFreePixmap(dpy, frame->pixmap);
+    free(frame->rectangles);
+  }
+
+  memcpy(&(frame->key), key, sizeof(frame_key_t));
+  frame->speculative = 0;
+  frame->pixmap = XCreatePixmap(dpy, ov->zone, key->w, key->h, ov->depth);
+  XCopyArea(dpy, ov->canvas, frame->pixmap, ov->canvas_gc,
+            0, 0, key->w, key->h, 0, 0);
+  frame->nrectangles = nclip_rectangles;
+  frame->rectangles = malloc(nclip_rectangles * sizeof(XRectangle));
+  memcpy(frame->rectangles, clip_rectangles,
+         nclip_rectangles * sizeof(XRectangle));
+
+  /* Mark it used so it isn't the next one evicted */
+  frame_cache_lookup(ov, key);
+  return frame;
+}
+
+void frame_cache_clear(overlay_t *ov) {
+  int i;
+
+  for (i = 0; i < ov->nframes; i++) {
+    XFreePixmap(dpy, ov->frames[i].pixmap);
+    free(ov->frames[i].rectangles);
+  }
+  free(ov->frames);
+  ov->frames = NULL;
+  ov->nframes = 0;
+  ov->front = ov->canvas;
+}
+
+/* Drop every cached frame, used when the cache size changes. */
+void frame_caches_clear() {
+  int i;
+
+  for (i = 0; i < nviewports; i++) {
+    if (viewports[i].overlay != NULL && viewports[i].overlay != overlay)
+      frame_cache_clear(viewports[i].overlay);
+  }
+  if (overlay != NULL) {
+    frame_cache_clear(overlay);
+    appstate.need_draw = 1;
+  }
+}
+
+void correct_overflow() {
+  viewport_t *viewport = &(viewports[wininfo.curviewport]);
+
+  /* If the window is outside the boundaries of the screen, move it to the
+   * next screen that way, if there is one */
+  if (wininfo.x < viewport->x)
+    viewport_move(VIEWPORT_LEFT);
+  else if (wininfo.x + wininfo.w > viewport->x + viewport->w)
+    viewport_move(VIEWPORT_RIGHT);
+
+  viewport = &(viewports[wininfo.curviewport]);
+  if (wininfo.y < viewport->y)
+    viewport_move(VIEWPORT_UP);
+  else if (wininfo.y + wininfo.h > viewport->y + viewport->h)
+    viewport_move(VIEWPORT_DOWN);
+
+  /* Then bump it back inside whatever screen it ended up on */
+  viewport = &(viewports[wininfo.curviewport]);
+  if (wininfo.x + wininfo.w > viewport->x + viewport->w)
+    wininfo.x = viewport->x + viewport->w - wininfo.w;
+  if (wininfo.x < viewport->x)
+    wininfo.x = viewport->x;
+  if (wininfo.y + wininfo.h > viewport->y + viewport->h)
+    wininfo.y = viewport->y + viewport->h - wininfo.h;
+  if (wininfo.y < viewport->y)
+    wininfo.y = viewport->y;
+}
+
+/* Move the window onto the neighbouring viewport in the given direction,
+ * entering at the edge nearest the viewport it came from */
+void viewport_move(int direction) {
   int expand_w = 0, expand_h = 0;
+  int next = viewports[wininfo.curviewport].neighbor[direction];
+  viewport_t *viewport;
 
-  /* Expand if the current window is the size of the current viewport */
-  //printf("left %d] %d,%d vs %d,%d\n", wininfo.curviewport,
-         //wininfo.w, wininfo.h,
-         //viewports[wininfo.curviewport].w, viewports[wininfo.curviewport].h);
-  if (wininfo.curviewport == 0)
+  if (next < 0)
     return;
 
+  /* Expand if the current window is the size of the current viewport */
   if (wininfo.w == viewports[wininfo.curviewport].w)
     expand_w = 1;
-  if (wininfo.h == viewports[wininfo.curviewport].h) {
+  if (wininfo.h == viewports[wininfo.curviewport].h)
     expand_h = 1;
-  }
 
-  wininfo.curviewport--;
-  if (expand_w || wininfo.w > viewports[wininfo.curviewport].w) {
-    wininfo.w = viewports[wininfo.curviewport].w;
+  wininfo.curviewport = next;
+  viewport = &(viewports[next]);
+
+  if (expand_w || wininfo.w > viewport->w) {
+    wininfo.w = viewport->w;
+  }
+  if (expand_h || wininfo.h > viewport->h) {
+    wininfo.h = viewport->h;
   }
-  if (expand_h || wininfo.h > viewports[wininfo.curviewport].h) {
-    wininfo.h = viewports[wininfo.curviewport].h;
+
+  switch (direction) {
+    case VIEWPORT_LEFT:
+      wininfo.x = viewport->x + viewport->w - wininfo.w;
+      break;
+    case VIEWPORT_RIGHT:
+      wininfo.x = viewport->x;
+      break;
+    case VIEWPORT_UP:
+      wininfo.y = viewport->y + viewport->h - wininfo.h;
+      break;
+    case VIEWPORT_DOWN:
+      wininfo.y = viewport->y;
+      break;
   }
-  wininfo.x = viewports[wininfo.curviewport].w - wininfo.w;
 }
 
 void handle_keypress(XKeyEvent *e) {
-  int i;
-
   /* Only pay attention to shift. In particular, things not included here are
    * mouse buttons (active when dragging), numlock (including Mod2Mask) */
   e->state &= (ShiftMask | ControlMask | Mod1Mask | Mod3Mask | Mod4Mask | Mod4Mask);
 
+  /* Latency is measured from the first key of a batch that frame_commit
+   * handles in one frame */
+  if (keypress_time_us == 0)
+    keypress_time_us = now_us();
+
+  keypress_pointer.valid = 1;
+  keypress_pointer.root = e->root;
+  keypress_pointer.x = e->x_root;
+  keypress_pointer.y = e->y_root;
+
   if (appstate.recording == record_getkey) {
     if (handle_recording(e) == HANDLE_STOP) {
       return;
@@ -1551,18 +3719,12 @@ void handle_keypress(XKeyEvent *e) {
   }
 
   if (appstate.playback) {
-    /* Loop over known recordings */
-    for (i = 0; i < recordings->len; i++) {
-      recording_t *rec = g_ptr_array_index(recordings, i);
-      if (e->keycode == rec->keycode) {
-        int j = 0;
-        for (j = 0; j < rec->commands->len; j++) {
-          handle_commands(g_ptr_array_index(rec->commands, j));
-        }
-        break;
-      }
-    }
+    recording_t *rec = g_hash_table_lookup(recordings,
+                                           KEYBINDING_KEY(e->keycode, e->state));
     appstate.playback = 0;
+    if (rec != NULL) {
+      playback_run(rec);
+    }
     return;
   }
 
@@ -1572,106 +3734,85 @@ void handle_keypress(XKeyEvent *e) {
     }
   }
 
-  /* Loop over known keybindings */
-  for (i = 0; i < keybindings->len; i++) {
-    keybinding_t *kbt = g_ptr_array_index(keybindings, i);
-    int keycode = kbt->keycode;
-    int mods = kbt->mods;
-    char *commands = kbt->commands;
-    if ((keycode == e->keycode) && (mods == e->state)) {
-      handle_commands(commands);
-    }
+  keybinding_t *kbt = keybinding_lookup(e->keycode, e->state);
+  if (kbt != NULL) {
+    program_run(kbt->program);
   }
 } /* void handle_keypress */
 
 handler_info_t handle_recording(XKeyEvent *e) {
-  int i;
   appstate.recording = record_ing; /* start recording actions */
-  /* TODO(sissel): support keys with keystrokes like shift+a */
 
-  /* check existing recording keycodes if we need to override it */
-  for (i = 0; i < recordings->len; i++) {
-    recording_t *rec = (recording_t *) g_ptr_array_index(recordings, i);
-    if (rec->keycode == e->keycode) {
-      g_ptr_array_free(rec->commands, TRUE);
-      g_ptr_array_remove_index_fast(recordings, i);
-      i--; /* array removal will shift everything down one to make up for the
-            * loss we'll need to redo this index */
-    }
-  }
+  /* A new recording on this key replaces the old one */
+  g_hash_table_remove(recordings, KEYBINDING_KEY(e->keycode, e->state));
 
   //printf("Recording as keycode:%d\n", e->keycode);
   active_recording->keycode = e->keycode;
+  active_recording->mods = e->state;
   return HANDLE_STOP;
 }
 
 handler_info_t handle_gridnav(XKeyEvent *e) {
-  int index = 0;
-
-  if (e->state & 0x2000) { /* ISO Level3 Shift */
-    index += 2;
-  }
-  if (e->state & ShiftMask) {
-    index += 1;
-  }
-
-  KeySym sym = XkbKeycodeToKeysym(dpy, e->keycode, 0, index);
-  char *key = XKeysymToString(sym);
+  KeySym sym = XkbKeycodeToKeysym(dpy, e->keycode, 0, 0);
+  grid_labels_t *labels;
+  int symbol, node;
 
   if (sym == XK_Escape) {
-    cmd_grid_nav("off");
+    cmd_grid_nav(&(cmdarg_t){ .num = { GRID_NAV_OFF } });
     update();
     return HANDLE_STOP;
   }
 
-  if (!(strlen(key) == 1 && isalpha(*key))) {
+  label_keys_update();
+  symbol = label_keys[e->keycode];
+  if (symbol < 0) {
     return HANDLE_CONTINUE;
   }
-  int val = tolower(*key) - 'a';
 
-  if (val < 0) {
-    return HANDLE_CONTINUE;
+  labels = grid_labels_get(wininfo.grid_rows, wininfo.grid_cols);
+  node = label_child(labels, grid_nav_prefix(&wininfo), symbol);
+  if (node < 0) {
+    return HANDLE_CONTINUE; /* No label goes on with this key, pass */
   }
 
-  /* TODO(sissel): Only GRID_LABEL_AA supported right now */
-  if (appstate.grid_nav_state == GRID_NAV_COL) {
-    if (val >= wininfo.grid_cols) {
-      return HANDLE_CONTINUE; /* Invalid key in this grid, pass */
-    }
-    appstate.grid_nav_state = GRID_NAV_ROW;
-    appstate.grid_nav_col = val;
-    appstate.need_draw = 1;
-    update();
-    save_history_point();
-
-    /* We have a full set of coordinates now; select that grid position */
-    cell_select(appstate.grid_nav_col, appstate.grid_nav_row);
-    update();
-    save_history_point();
-    appstate.grid_nav_row = -1;
-    appstate.grid_nav_col = -1;
-  } else if (appstate.grid_nav_state == GRID_NAV_ROW) {
-    if (val >= wininfo.grid_rows) {
-      return HANDLE_CONTINUE; /* Invalid key in this grid, pass */
-    }
-    appstate.grid_nav_row = val;
-    appstate.grid_nav_state = GRID_NAV_COL;
+  if (labels->nodes[node].cell < 0) {
+    /* Part way through a label; narrow down the labels shown */
+    appstate.grid_nav_node = node;
+    appstate.grid_nav_rows = wininfo.grid_rows;
+    appstate.grid_nav_cols = wininfo.grid_cols;
     appstate.need_draw = 1;
     update();
-    save_history_point();
+    return HANDLE_STOP;
   }
+
+  /* We have a full label now; select that grid position */
+  int cell = labels->nodes[node].cell;
+  appstate.grid_nav_node = 0;
+  appstate.need_draw = 1;
+  cell_select(cell % wininfo.grid_cols, cell / wininfo.grid_cols);
+  update();
+  save_history_point();
   return HANDLE_STOP;
 }
 
-void handle_commands(char *commands) {
+/* Compile a command string into a program. Any unknown command or bad
+ * argument is reported and makes the whole string fail to compile. */
+program_t *program_compile(const char *commands) {
   char *cmdcopy;
-  char *tokctx, *tok, *strptr, *copyptr;
+  char *tok, *strptr, *copyptr;
   int is_quoted, is_escaped;
+  program_t *program;
+  int errors = 0;
+
+  program = calloc(sizeof(program_t), 1);
+  program->refs = 1;
 
-  //printf("Commands; %s\n", commands);
   cmdcopy = strdup(commands);
   copyptr = cmdcopy;
   while (*copyptr != '\0') {
+    const char *source = commands + (copyptr - cmdcopy);
+    size_t source_len;
+
     /* Parse with knowledge of quotes and escaping */
     is_quoted = is_escaped = FALSE;
     strptr = tok = copyptr;
@@ -1694,6 +3835,7 @@ void handle_commands(char *commands) {
       strptr++;
       copyptr++;
     }
+    source_len = strnlen(source, commands + (copyptr - cmdcopy) - source);
 
     if (*strptr != '\0') {
       *strptr = '\0';
@@ -1702,27 +3844,19 @@ void handle_commands(char *commands) {
     }
 
     int i;
-    int found = 0;
-    strptr = NULL;
+    const dispatch_t *found = NULL;
+    char *args = NULL;
 
     /* Ignore leading whitespace */
     while (isspace(*tok))
       tok++;
-
-    /* Record this command (if the command is not 'record') */
-    if (appstate.recording == record_ing && strncmp(tok, "record", 6)) {
-      //printf("Record: %s\n", tok);
-      g_ptr_array_add(active_recording->commands, (gpointer) strdup(tok));
+    while (source_len > 0 && isspace(*source)) {
+      source++;
+      source_len--;
     }
 
     for (i = 0; dispatch[i].command && !found; i++) {
-      /* XXX: This approach means we can't have one command be a subset of
-       * another. For example, 'grid' and 'grid-foo' will fail because when you
-       * use 'grid-foo' it'll match 'grid' first.
-       * This hasn't been a problem yet...
-       */
-
-      /* If this command starts with a dispatch function, call it */
+      /* If this command starts with a dispatch function, use it */
       size_t cmdlen = strlen(dispatch[i].command);
       size_t tokcmdlen = strcspn(tok, " \t");
       if (cmdlen == tokcmdlen && !strncmp(tok, dispatch[i].command, cmdlen)) {
@@ -1730,20 +3864,98 @@ void handle_commands(char *commands) {
          * "command arg1 arg2"
          *          ^^^^^^^^^ <-- this
          */
-        char *args = tok + cmdlen;
+        args = tok + cmdlen;
 
         if (*args == '\0')
           args = "";
         else
           args++;
 
-        found = 1;
-        dispatch[i].func(args);
+        found = &dispatch[i];
       }
     }
 
-    if (!found)
+    if (!found) {
       fprintf(stderr, "No such command: '%s'\n", tok);
+      errors++;
+      continue;
+    }
+
+    program->commands = realloc(program->commands,
+                                (program->ncommands + 1) * sizeof(command_t));
+    command_t *cmd = &(program->commands[program->ncommands]);
+    memset(cmd, 0, sizeof(command_t));
+    cmd->dispatch = found;
+    cmd->text = strndup(source, source_len);
+    program->ncommands++;
+
+    if (found->parse(args, &cmd->arg) != 0) {
+      fprintf(stderr, "Invalid arguments for '%s': '%s'\n",
+              found->command, args);
+      errors++;
+    }
+  }
+
+  free(cmdcopy);
+
+  if (errors > 0 || program->ncommands == 0) {
+    program_free(program);
+    return NULL;
+  }
+  return program;
+}
+
+/* Drop a reference to program, freeing it with the last one */
+void program_free(program_t *program) {
+  int i;
+  if (program == NULL || --program->refs > 0)
+    return;
+
+  for (i = 0; i < program->ncommands; i++) {
+    free(program->commands[i].text);
+    free(program->commands[i].arg.str);
+  }
+  free(program->commands);
+  free(program);
+}
+
+void program_run(program_t *program) {
+  int i;
+
+  program->refs++;
+  for (i = 0; i < program->ncommands; i++) {
+    const command_t *cmd = &(program->commands[i]);
+
+    /* A start while a keyboard grab is pending (or that just found the
+     * keyboard grabbed) waits, along with the rest of the program. */
+    if (grab_pending && !ISACTIVE
+        && (cmd->dispatch->func == cmd_start
+            || cmd->dispatch->func == cmd_toggle_start)) {
+      program_queue_rest(program, i);
+      break;
+    }
+
+    /* Commands that act on the pointer or run programs should see the
+     * window as it is on screen, so show any geometry change first */
+    if ((cmd->dispatch->flags & CMD_FLUSH) && ISACTIVE) {
+      update();
+      if (appstate.need_frame)
+        frame_commit();
+    }
+
+    /* Record this command (if the command is not 'record') */
+    if (appstate.recording == record_ing && cmd->dispatch->func != cmd_record) {
+      g_ptr_array_add(active_recording->commands, (gpointer) strdup(cmd->text));
+    }
+
+    cmd->dispatch->func(&cmd->arg);
+
+    if (grab_pending && !ISACTIVE
+        && (cmd->dispatch->func == cmd_start
+            || cmd->dispatch->func == cmd_toggle_start)) {
+      program_queue_rest(program, i);
+      break;
+    }
   }
 
   if (ISACTIVE) {
@@ -1752,153 +3964,553 @@ void handle_commands(char *commands) {
     update();
     save_history_point();
   }
+  program_free(program);
+}
 
-  free(cmdcopy);
+/* Queue commands first..end of program as a command string for grab_retry */
+void program_queue_rest(const program_t *program, int first) {
+  GString *rest = g_string_new(NULL);
+  int i;
+
+  for (i = first; i < program->ncommands; i++) {
+    if (rest->len > 0)
+      g_string_append_c(rest, ',');
+    g_string_append(rest, program->commands[i].text);
+  }
+  grab_queue_push(g_string_free(rest, FALSE));
+}
+
+/* Run a command string that was not compiled ahead of time, such as one
+ * given on the command line. */
+int handle_commands(char *commands) {
+  program_t *program = program_compile(commands);
+  if (program == NULL)
+    return 1;
+
+  program_run(program);
+  program_free(program);
+  return 0;
+}
+
+int parse_arg_none(const char *args, cmdarg_t *arg) {
+  return 0;
+}
+
+int parse_arg_value(const char *args, cmdarg_t *arg) {
+  /* Parse a float. If this fails, the command uses its default value */
+  arg->count = (sscanf(args, "%f", &arg->value) > 0);
+  return 0;
+}
+
+int parse_arg_size(const char *args, cmdarg_t *arg) {
+  arg->count = sscanf(args, "%d %d", &arg->num[0], &arg->num[1]);
+  if (arg->count <= 0) {
+    fprintf(stderr, "Expected at least 1 argument (width [height])\n");
+    return 1;
+  } else if (arg->count == 1) {
+    /* If only one argument, assume we want a square. */
+    arg->num[1] = arg->num[0];
+  }
+  return 0;
+}
+
+int parse_arg_grid(const char *args, cmdarg_t *arg) {
+  // Try to parse 'NxN' where N is a number.
+  if (sscanf(args, "%dx%d", &arg->num[0], &arg->num[1]) < 2) {
+    // Otherwise, try parsing a number.
+    arg->num[0] = arg->num[1] = atoi(args);
+  }
+
+  if (arg->num[0] <= 0 || arg->num[1] <= 0) {
+    fprintf(stderr, "Invalid grid segmentation: %dx%d\n",
+            arg->num[0], arg->num[1]);
+    fprintf(stderr, "Grid x and y must both be greater than 0.\n");
+    return 1;
+  }
+  return 0;
+}
+
+int parse_arg_grid_nav(const char *args, cmdarg_t *arg) {
+  if (!strcmp("on", args)) {
+    arg->num[0] = GRID_NAV_ON;
+  } else if (!strcmp("off", args)) {
+    arg->num[0] = GRID_NAV_OFF;
+  } else if (!strcmp("toggle", args)) {
+    arg->num[0] = GRID_NAV_TOGGLE;
+  } else if (*args == '\0') {
+    arg->num[0] = GRID_NAV_KEEP;
+  } else {
+    fprintf(stderr, "Expected one of: on, off, toggle\n");
+    return 1;
+  }
+  return 0;
+}
+
+int parse_arg_cell(const char *args, cmdarg_t *arg) {
+  // Try to parse 'NxM' where N and M are a number.
+  if (sscanf(args, "%dx%d", &arg->num[0], &arg->num[1]) == 2) {
+    arg->count = 2;
+    if (arg->num[0] <= 0 && arg->num[1] <= 0) {
+      fprintf(stderr, "Cell number cannot be zero or negative. I was given"
+              "columns=%d and rows=%d\n", arg->num[0], arg->num[1]);
+      return 1;
+    }
+  } else {
+    // Otherwise, try parsing just number.
+    arg->count = 1;
+    arg->num[0] = atoi(args);
+    if (arg->num[0] <= 0) {
+      fprintf(stderr, "Cell number cannot be zero or negative: '%s'\n", args);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int parse_arg_button(const char *args, cmdarg_t *arg) {
+  arg->num[0] = atoi(args);
+  if (arg->num[0] <= 0) {
+    fprintf(stderr, "Negative mouse button is invalid: %d\n", arg->num[0]);
+    return 1;
+  }
+  return 0;
+}
+
+int parse_arg_drag(const char *args, cmdarg_t *arg) {
+  char modkeys[128] = "";
+  int count = sscanf(args, "%d %127s", &arg->num[0], modkeys);
+
+  if (count <= 0) {
+    arg->num[0] = 1; /* Default to left mouse button */
+  }
+
+  if (arg->num[0] <= 0) {
+    fprintf(stderr, "Negative or no mouse button given. Not valid. Button read was '%d'\n", arg->num[0]);
+    return 1;
+  }
+  arg->str = strdup(modkeys);
+  return 0;
+}
+
+int parse_arg_set(const char *args, cmdarg_t *arg) {
+  char name[64];
+  char value[64];
+  int i;
+
+  if (sscanf(args, "%63s %63s", name, value) != 2) {
+    fprintf(stderr, "Expected: set <option> <value>\n");
+    return 1;
+  }
+
+  for (i = 0; options[i].name != NULL; i++) {
+    if (!strcmp(options[i].name, name))
+      break;
+  }
+  if (options[i].name == NULL) {
+    fprintf(stderr, "No such option: '%s'\n", name);
+    return 1;
+  }
+  arg->num[0] = i;
+
+  switch (options[i].type) {
+    case OPTION_BOOL:
+      if (!strcmp(value, "on") || !strcmp(value, "true") || !strcmp(value, "1")) {
+        arg->num[1] = 1;
+      } else if (!strcmp(value, "off") || !strcmp(value, "false")
+                 || !strcmp(value, "0")) {
+        arg->num[1] = 0;
+      } else {
+        fprintf(stderr, "Option '%s' expects on or off, got '%s'\n",
+                name, value);
+        return 1;
+      }
+      break;
+    case OPTION_INT:
+      if (sscanf(value, "%d", &arg->num[1]) != 1 || arg->num[1] < 0) {
+        fprintf(stderr, "Option '%s' expects a number, got '%s'\n",
+                name, value);
+        return 1;
+      }
+      break;
+    case OPTION_STRING:
+      /* Take the rest of the line so values may contain spaces */
+      args += strspn(args, " \t");
+      args += strcspn(args, " \t");
+      args += strspn(args, " \t");
+      return parse_arg_string(args, arg);
+  }
+  return 0;
+}
+
+int parse_arg_string(const char *args, cmdarg_t *arg) {
+  size_t len = strlen(args);
+
+  // Trim leading and trailing quotes if they exist
+  if (len > 0 && *args == '"') {
+    args++;
+    len -= (len > 1) ? 2 : 1;
+  }
+  arg->str = strndup(args, len);
+  return 0;
+}
+
+wininfo_t *history_entry(unsigned long position) {
+  return &(wininfo_history[position % history_ring_size]);
+}
+
+void history_clear() {
+  history_first = history_cursor = history_end = 0;
+}
+
+/* Resize the ring, keeping the newest entries that still fit */
+void history_depth_changed() {
+  wininfo_t *ring;
+  unsigned long pos;
+  int depth = MAX(history_depth, 1);
+
+  ring = calloc(depth, sizeof(wininfo_t));
+  if (history_end - history_first > depth)
+    history_first = history_end - depth;
+  if (history_cursor < history_first)
+    history_cursor = history_first;
+  for (pos = history_first; pos < history_end; pos++)
+    ring[pos % depth] = *history_entry(pos);
+
+  free(wininfo_history);
+  wininfo_history = ring;
+  history_ring_size = depth;
 }
 
 void save_history_point() {
-  /* If the history is full, drop the oldest entry */
-  while (wininfo_history_cursor >= WININFO_MAXHIST) {
-    int i;
-    for (i = 1; i < wininfo_history_cursor; i++) {
-      memcpy(&(wininfo_history[i - 1]),
-             &(wininfo_history[i]),
-             sizeof(wininfo_t));
+  if (wininfo_history == NULL)
+    history_depth_changed();
+
+  /* Repeating the current entry would only make history-back a no-op */
+  if (history_end > history_first
+      && !memcmp(history_entry(history_cursor), &wininfo, sizeof(wininfo_t)))
+    return;
+
+  if (history_end > history_first)
+    history_cursor++;
+
+  /* A new entry discards anything history-forward could have returned to,
+   * and once the ring is full it overwrites the oldest entry */
+  *history_entry(history_cursor) = wininfo;
+  history_end = history_cursor + 1;
+  if (history_end - history_first > history_ring_size)
+    history_first = history_end - history_ring_size;
+}
+
+/* Go back moves_ago entries, or forward if it is negative */
+void restore_history_point(int moves_ago) {
+  if (history_end == history_first)
+    return;
+
+  if (moves_ago > 0) {
+    if (moves_ago > history_cursor - history_first)
+      moves_ago = history_cursor - history_first;
+    history_cursor -= moves_ago;
+  } else {
+    if (-moves_ago > history_end - 1 - history_cursor)
+      moves_ago = -(int)(history_end - 1 - history_cursor);
+    history_cursor += -moves_ago;
+  }
+
+  memcpy(&wininfo, history_entry(history_cursor), sizeof(wininfo));
+  appstate.need_draw = 1;
+  appstate.need_moveresize = 1;
+}
+
+/* Sort viewports, left to right, then top to bottom. Movement between
+ * viewports goes by the links from viewports_link, not by this order. */
+int viewport_sort(const void *a, const void *b) {
+  viewport_t *va = (viewport_t *)a;
+  viewport_t *vb = (viewport_t *)b;
+
+  if (va->x != vb->x)
+    return va->x - vb->x;
+  return va->y - vb->y;
+}
+
+void query_screens() {
+  int dummyint;
+  viewport_t *table = NULL;
+  int ntable;
+  int *moved;
+  int i, j;
+  unsigned long pos;
+
+  /* Build the new viewport table without touching the current one, so the
+   * two can be compared */
+  ntable = query_screen_randr(&table);
+  if (ntable > 0) {
+    xinerama = True;
+  } else if (XineramaQueryExtension(dpy, &dummyint, &dummyint)
+             && XineramaIsActive(dpy)) {
+    xinerama = True;
+    ntable = query_screen_xinerama(&table);
+  } else { /* No xinerama */
+    xinerama = False;
+    ntable = query_screen_normal(&table);
+  }
+
+  if (xinerama)
+    qsort(table, ntable, sizeof(viewport_t), viewport_sort);
+
+  /* moved[old index] is the viewport's index in the new table, or -1 if
+   * it is gone or changed. Viewports that are unchanged keep their
+   * overlays, with the windows, pixmaps and frame caches in them. */
+  moved = malloc(MAX(nviewports, 1) * sizeof(int));
+  for (j = 0; j < nviewports; j++) {
+    moved[j] = -1;
+    for (i = 0; i < ntable; i++) {
+      if (table[i].root == viewports[j].root
+          && table[i].x == viewports[j].x && table[i].y == viewports[j].y
+          && table[i].w == viewports[j].w && table[i].h == viewports[j].h
+          && table[i].overlay == NULL) {
+        moved[j] = i;
+        table[i].overlay = viewports[j].overlay;
+        viewports[j].overlay = NULL;
+        break;
+      }
     }
-    wininfo_history_cursor--;
   }
 
-  memcpy(&(wininfo_history[wininfo_history_cursor]),
-         &(wininfo),
-         sizeof(wininfo));
+  /* The active window was sized for its viewport; if that changed, stop
+   * rather than draw into the wrong geometry */
+  if (ISACTIVE && moved[wininfo.curviewport] == -1) {
+    cmd_end(NULL);
+  }
+
+  for (j = 0; j < nviewports; j++) {
+    if (viewports[j].overlay != NULL)
+      overlay_free(viewports[j].overlay);
+  }
+
+  if (ISACTIVE) {
+    wininfo.curviewport = moved[wininfo.curviewport];
+    for (pos = history_first; pos < history_end; pos++) {
+      wininfo_t *entry = history_entry(pos);
+      if (entry->curviewport >= 0 && entry->curviewport < nviewports
+          && moved[entry->curviewport] != -1) {
+        entry->curviewport = moved[entry->curviewport];
+      } else {
+        entry->curviewport = wininfo.curviewport;
+      }
+    }
+  }
+  free(moved);
+
+  free(viewports);
+  viewports = table;
+  nviewports = ntable;
 
-  wininfo_history_cursor++;
+  viewports_link();
+  overlays_prepare();
 }
 
-void restore_history_point(int moves_ago) {
-  wininfo_history_cursor -= moves_ago + 1;
-  if (wininfo_history_cursor < 0) {
-    wininfo_history_cursor = 0;
+/* One viewport per active CRTC, from the server's current configuration
+ * (XRRGetScreenResourcesCurrent doesn't make it probe for new outputs).
+ * Returns 0 if RandR 1.3 is not available or found nothing to use. */
+int query_screen_randr(viewport_t **table) {
+  static int have_randr = -1;
+  XRRScreenResources *resources;
+  Window root = DefaultRootWindow(dpy);
+  int i, j, n = 0;
+
+  if (have_randr == -1) {
+    int dummyint, major = 0, minor = 0;
+    have_randr = XRRQueryExtension(dpy, &dummyint, &dummyint)
+                 && XRRQueryVersion(dpy, &major, &minor)
+                 && (major > 1 || (major == 1 && minor >= 3));
   }
 
-  wininfo_t *previous = &(wininfo_history[wininfo_history_cursor]);
-  memcpy(&wininfo, previous, sizeof(wininfo));
-  appstate.need_draw = 1;
-  appstate.need_moveresize = 1;
-}
+  /* Separate X screens are handled by query_screen_normal */
+  if (!have_randr || ScreenCount(dpy) > 1)
+    return 0;
 
-/* Sort viewports, left to right.
- * This may perform undesirably for vertically-stacked viewports or
- * for other odd configurations */
-int viewport_sort(const void *a, const void *b) {
-  viewport_t *va = (viewport_t *)a;
-  viewport_t *vb = (viewport_t *)b;
+  resources = XRRGetScreenResourcesCurrent(dpy, root);
+  if (resources == NULL)
+    return 0;
 
-  return va->x - vb->x;
-}
+  *table = calloc(MAX(resources->ncrtc, 1), sizeof(viewport_t));
+  for (i = 0; i < resources->ncrtc; i++) {
+    XRRCrtcInfo *crtc = XRRGetCrtcInfo(dpy, resources, resources->crtcs[i]);
+    if (crtc == NULL)
+      continue;
 
-void query_screens() {
-  int dummyint;
-  if (XineramaQueryExtension(dpy, &dummyint, &dummyint)
-      && XineramaIsActive(dpy)) {
-    xinerama = True;
-    query_screen_xinerama();
-  } else { /* No xinerama */
-    query_screen_normal();
+    if (crtc->mode != None && crtc->noutput > 0) {
+      /* Mirrored outputs share a CRTC geometry; keep one viewport */
+      for (j = 0; j < n; j++) {
+        if ((*table)[j].x == crtc->x && (*table)[j].y == crtc->y
+            && (*table)[j].w == crtc->width && (*table)[j].h == crtc->height)
+          break;
+      }
+      if (j == n) {
+        (*table)[n].x = crtc->x;
+        (*table)[n].y = crtc->y;
+        (*table)[n].w = crtc->width;
+        (*table)[n].h = crtc->height;
+        (*table)[n].screen_num = 0;
+        (*table)[n].screen = ScreenOfDisplay(dpy, 0);
+        (*table)[n].root = root;
+        n++;
+      }
+    }
+    XRRFreeCrtcInfo(crtc);
   }
+  XRRFreeScreenResources(resources);
 
-  qsort(viewports, nviewports, sizeof(viewport_t), viewport_sort);
+  if (n == 0) {
+    free(*table);
+    *table = NULL;
+  }
+  return n;
 }
 
-void query_screen_xinerama() {
-  int i;
+int query_screen_xinerama(viewport_t **table) {
+  int i, n;
   XineramaScreenInfo *screeninfo;
 
-  screeninfo = XineramaQueryScreens(dpy, &nviewports);
-  free(viewports);
-  viewports = calloc(nviewports, sizeof(viewport_t));
-  for (i = 0; i < nviewports; i++) {
-    viewports[i].x = screeninfo[i].x_org;
-    viewports[i].y = screeninfo[i].y_org;
-    viewports[i].w = screeninfo[i].width;
-    viewports[i].h = screeninfo[i].height;
-    viewports[i].screen_num = 0;
-    viewports[i].screen = ScreenOfDisplay(dpy, 0);
-    viewports[i].root = DefaultRootWindow(dpy);
+  screeninfo = XineramaQueryScreens(dpy, &n);
+  *table = calloc(MAX(n, 1), sizeof(viewport_t));
+  for (i = 0; i < n; i++) {
+    (*table)[i].x = screeninfo[i].x_org;
+    (*table)[i].y = screeninfo[i].y_org;
+    (*table)[i].w = screeninfo[i].width;
+    (*table)[i].h = screeninfo[i].height;
+    (*table)[i].screen_num = 0;
+    (*table)[i].screen = ScreenOfDisplay(dpy, 0);
+    (*table)[i].root = DefaultRootWindow(dpy);
   }
   XFree(screeninfo);
+  return n;
 }
 
-void query_screen_normal() {
-  int i;
+int query_screen_normal(viewport_t **table) {
+  int i, n;
   Screen *s;
-  nviewports = ScreenCount(dpy);
-  free(viewports);
-  viewports = calloc(nviewports, sizeof(viewport_t));
+  n = ScreenCount(dpy);
+  *table = calloc(n, sizeof(viewport_t));
 
-  for (i = 0; i < nviewports; i++) {
+  for (i = 0; i < n; i++) {
     s = ScreenOfDisplay(dpy, i);
-    viewports[i].x = 0;
-    viewports[i].y = 0;
-    viewports[i].w = s->width;
-    viewports[i].h = s->height;
-    viewports[i].root = RootWindowOfScreen(s);
-    viewports[i].screen_num = i;
-    viewports[i].screen = s; }
+    (*table)[i].x = 0;
+    (*table)[i].y = 0;
+    (*table)[i].w = s->width;
+    (*table)[i].h = s->height;
+    (*table)[i].root = RootWindowOfScreen(s);
+    (*table)[i].screen_num = i;
+    (*table)[i].screen = s;
+  }
+  return n;
 }
 
-int query_current_screen() {
-  int i;
-  if (xinerama) {
-    return query_current_screen_xinerama();
+/* How far 'to' lies from 'from' in the given direction, or -1 if it is not
+ * in that direction at all. The distance is the gap between the facing
+ * edges, plus how far apart the screens are along the other axis, so a
+ * screen that lines up beats one that is only diagonally adjacent. */
+int viewport_distance(const viewport_t *from, const viewport_t *to,
+                      int direction) {
+  int gap, offset = 0;
+
+  switch (direction) {
+    case VIEWPORT_LEFT: gap = from->x - (to->x + to->w); break;
+    case VIEWPORT_RIGHT: gap = to->x - (from->x + from->w); break;
+    case VIEWPORT_UP: gap = from->y - (to->y + to->h); break;
+    case VIEWPORT_DOWN: gap = to->y - (from->y + from->h); break;
+    default: return -1;
+  }
+  if (gap < 0)
+    return -1;
+
+  if (direction == VIEWPORT_LEFT || direction == VIEWPORT_RIGHT) {
+    if (to->y >= from->y + from->h)
+      offset = to->y - (from->y + from->h);
+    else if (from->y >= to->y + to->h)
+      offset = from->y - (to->y + to->h);
   } else {
-    return query_current_screen_normal();
+    if (to->x >= from->x + from->w)
+      offset = to->x - (from->x + from->w);
+    else if (from->x >= to->x + to->w)
+      offset = from->x - (to->x + to->w);
   }
+  return gap + offset;
 }
 
-int query_current_screen_xinerama() {
-  int i = 0, dummyint;
-  unsigned int dummyuint;
-  int x, y;
-  Window dummywin;
-  Window root = viewports[0].root;
-  XQueryPointer(dpy, root, &dummywin, &dummywin,
-                &x, &y, &dummyint, &dummyint, &dummyuint);
+/* Link each viewport to its nearest neighbour in all four directions, so
+ * moving across screens is a lookup. Screens without xinerama all sit at
+ * 0,0 on their own roots; those are simply chained left to right. */
+void viewports_link() {
+  int i, j, direction;
 
-  /* Figure which display the cursor is on */
   for (i = 0; i < nviewports; i++) {
-    if (pointinrect(x, y, viewports[i].x, viewports[i].y,
-                    viewports[i].w, viewports[i].h)) {
-      return i;
+    viewport_t *from = &(viewports[i]);
+
+    for (direction = 0; direction < VIEWPORT_NDIRECTIONS; direction++)
+      from->neighbor[direction] = -1;
+
+    if (!xinerama) {
+      from->neighbor[VIEWPORT_LEFT] = i - 1;
+      from->neighbor[VIEWPORT_RIGHT] = (i + 1 < nviewports) ? i + 1 : -1;
+      continue;
     }
-  }
 
-  return -1;
+    for (direction = 0; direction < VIEWPORT_NDIRECTIONS; direction++) {
+      int best = -1, best_distance = 0;
+      for (j = 0; j < nviewports; j++) {
+        int distance;
+        if (j == i)
+          continue;
+        distance = viewport_distance(from, &(viewports[j]), direction);
+        if (distance >= 0 && (best == -1 || distance < best_distance)) {
+          best = j;
+          best_distance = distance;
+        }
+      }
+      from->neighbor[direction] = best;
+    }
+  }
 }
 
-int query_current_screen_normal() {
-  int i = 0, dummyint;
-  unsigned int dummyuint;
-  int x, y;
-  Window dummywin;
-  Window root = viewports[0].root;
-  /* Query each Screen's root window to ask if the pointer is in it.
-   * I don't know of any other better way to ask what Screen is
-   * active (where is the cursor) */
+/* The viewport containing x,y on the given root window, or -1 */
+int viewport_at(Window root, int x, int y) {
+  int i;
+
   for (i = 0; i < nviewports; i++) {
-    if (!XQueryPointer(dpy, viewports[i].root, &dummywin, &dummywin,
-                      &x, &y, &dummyint, &dummyint, &dummyuint))
+    if (viewports[i].root != root)
       continue;
-
     if (pointinrect(x, y, viewports[i].x, viewports[i].y,
                     viewports[i].w, viewports[i].h)) {
       return i;
     }
   }
-
   return -1;
 }
 
+/* The viewport the pointer is on. During a key press that is where the
+ * pointer was when the key went down; otherwise we have to ask. */
+int query_current_screen() {
+  int dummyint;
+  unsigned int dummyuint;
+  int x, y;
+  Window root, dummywin;
+
+  if (keypress_pointer.valid)
+    return viewport_at(keypress_pointer.root, keypress_pointer.x,
+                       keypress_pointer.y);
+
+  /* The root returned is whichever root the pointer is on, with x,y
+   * relative to it, so one query covers every screen */
+  if (nviewports == 0)
+    return -1;
+  root = None;
+  XQueryPointer(dpy, viewports[0].root, &root, &dummywin,
+                &x, &y, &dummyint, &dummyint, &dummyuint);
+
+  return viewport_at(root, x, y);
+}
+
 int pointinrect(int px, int py, int rx, int ry, int rw, int rh) {
   return (px >= rx)
           && (px <= rx + rw)
@@ -1921,40 +4533,324 @@ void restart() {
   execvp(g_argv[0], g_argv);
 }
 
-void recordings_save(const char *filename) {
-  FILE *output = NULL;
-  int i = 0;
+/* Recordings are kept in an append-only journal. After a short header,
+ * every record is a length and CRC-32 followed by a payload that either
+ * stores a macro (key, mods and each recorded command) or deletes one.
+ * Stopping a recording appends one record, so earlier macros are never
+ * rewritten; a record torn by a crash fails its CRC and is dropped, along
+ * with anything after it. When most records are stale, the journal is
+ * compacted by writing the live macros to a new file and renaming it over
+ * the old one. */
+#define JOURNAL_MAGIC "KNMJ"
+#define JOURNAL_FORMAT 1
+
+enum { JOURNAL_MACRO = 1, JOURNAL_DELETE = 2 };
+
+typedef struct journal_header {
+  char magic[4];
+  uint32_t format;
+} journal_header_t;
+
+typedef struct journal_record {
+  uint32_t length; /* of the payload that follows */
+  uint32_t crc;    /* CRC-32 of the payload */
+} journal_record_t;
+
+/* Payload; for JOURNAL_MACRO, followed by ncommands of (uint32_t length,
+ * command bytes) */
+typedef struct journal_macro {
+  uint32_t type;
+  int32_t keycode;
+  int32_t mods;
+  uint32_t ncommands;
+} journal_macro_t;
+
+/* End of the last intact record, or 0 when the file on disk is not a
+ * journal we can append to: a format we don't know, or an old text file
+ * that could not be converted. */
+static off_t journal_end = 0;
+static unsigned int journal_records = 0;
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len) {
+  static uint32_t table[256];
+  static int have_table = 0;
+  const unsigned char *p = data;
+  uint32_t i, j;
+
+  if (!have_table) {
+    for (i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (j = 0; j < 8; j++)
+        c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      table[i] = c;
+    }
+    have_table = 1;
+  }
 
-  output = fopen(filename, "w");
-  if (output == NULL) {
-    fprintf(stderr, "Failure opening '%s' for write: %s\n", filename, strerror(errno));
-    return; /* Should we exit instead? */
+  crc = ~crc;
+  while (len-- > 0)
+    crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+void recording_free(gpointer data) {
+  recording_t *rec = data;
+  g_ptr_array_foreach(rec->commands, (GFunc)free, NULL);
+  g_ptr_array_free(rec->commands, TRUE);
+  program_free(rec->program);
+  free(rec);
+}
+
+/* Add rec to the recordings, compiling it once for playback */
+void recording_store(recording_t *rec) {
+  GString *commands = g_string_new(NULL);
+  int i;
+
+  for (i = 0; i < rec->commands->len; i++) {
+    if (i > 0)
+      g_string_append_c(commands, ',');
+    g_string_append(commands, g_ptr_array_index(rec->commands, i));
   }
+  program_free(rec->program);
+  rec->program = program_compile(commands->str);
+  g_string_free(commands, TRUE);
 
-  for (i = 0; i < recordings->len; i++) {
-    int j;
-    recording_t *rec = g_ptr_array_index(recordings, i);
-    if (rec->commands->len == 0)
-      continue;
+  g_hash_table_replace(recordings, KEYBINDING_KEY(rec->keycode, rec->mods),
+                       rec);
+}
+
+/* Replay a recording as one program: geometry steps only change wininfo,
+ * so the result is drawn once at the end, and anything touching the
+ * pointer or running a program first brings the screen up to date (see
+ * CMD_FLUSH). With playback-animate on, each step is drawn as it runs. */
+void playback_run(const recording_t *rec) {
+  int i;
+
+  if (!playback_animate && rec->program != NULL) {
+    program_run(rec->program);
+    return;
+  }
+
+  /* A recording that doesn't compile as a whole (say, one command that no
+   * longer exists) still runs its other commands, as it always has */
+  if (rec->program == NULL) {
+    const char *key = XKeysymToString(XkbKeycodeToKeysym(dpy, rec->keycode,
+                                                         0, 0));
+    fprintf(stderr, "The recording on key %s (keycode %d) has errors; "
+            "running its commands one at a time\n",
+            key ? key : "?", rec->keycode);
+  }
+
+  for (i = 0; i < rec->commands->len; i++) {
+    handle_commands(g_ptr_array_index(rec->commands, i));
+    if (appstate.need_frame) {
+      frame_commit();
+      XFlush(dpy);
+    }
+  }
+}
+
+/* Encode a complete record (header and payload) for rec */
+GByteArray *journal_encode(const recording_t *rec, int type) {
+  GByteArray *record = g_byte_array_new();
+  journal_record_t header = { 0, 0 };
+  journal_macro_t macro;
+  uint32_t i;
+
+  g_byte_array_append(record, (guint8 *)&header, sizeof(header));
+  macro.type = type;
+  macro.keycode = rec->keycode;
+  macro.mods = rec->mods;
+  macro.ncommands = (type == JOURNAL_MACRO) ? rec->commands->len : 0;
+  g_byte_array_append(record, (guint8 *)&macro, sizeof(macro));
+  for (i = 0; i < macro.ncommands; i++) {
+    const char *command = g_ptr_array_index(rec->commands, i);
+    uint32_t len = strlen(command);
+    g_byte_array_append(record, (guint8 *)&len, sizeof(len));
+    g_byte_array_append(record, (guint8 *)command, len);
+  }
+
+  header.length = record->len - sizeof(header);
+  header.crc = crc32_update(0, record->data + sizeof(header), header.length);
+  memcpy(record->data, &header, sizeof(header));
+  return record;
+}
+
+/* Apply one record's payload to the recordings table. Returns 0 if it was
+ * well formed. */
+int journal_apply(const char *payload, uint32_t length) {
+  journal_macro_t macro;
+  recording_t *rec;
+  const char *p = payload + sizeof(macro);
+  const char *end = payload + length;
+  uint32_t i;
+
+  if (length < sizeof(macro))
+    return 1;
+  memcpy(&macro, payload, sizeof(macro));
+
+  if (macro.type == JOURNAL_DELETE) {
+    g_hash_table_remove(recordings, KEYBINDING_KEY(macro.keycode, macro.mods));
+    return 0;
+  } else if (macro.type != JOURNAL_MACRO) {
+    return 1;
+  }
 
-    fprintf(output, "%d ", rec->keycode);
-    for (j = 0; j < rec->commands->len; j++) {
-      fprintf(output, "%s%s",
-              (char *) g_ptr_array_index(rec->commands, j),
-              (j + 1 < rec->commands->len ? ", " : ""));
+  rec = calloc(sizeof(recording_t), 1);
+  rec->keycode = macro.keycode;
+  rec->mods = macro.mods;
+  rec->commands = g_ptr_array_new();
+  for (i = 0; i < macro.ncommands; i++) {
+    uint32_t len;
+    if (end - p < sizeof(len)) {
+      recording_free(rec);
+      return 1;
+    }
+    memcpy(&len, p, sizeof(len));
+    p += sizeof(len);
+    if (end - p < len) {
+      recording_free(rec);
+      return 1;
     }
+    g_ptr_array_add(rec->commands, strndup(p, len));
+    p += len;
+  }
+  recording_store(rec);
+  return 0;
+}
 
-    fprintf(output, "\n");
+/* Write the live recordings to a new journal and rename it into place */
+void recordings_compact(const char *filename) {
+  journal_header_t header;
+  GHashTableIter iter;
+  gpointer value;
+  char *tmppath;
+  off_t size;
+  int fd, ok = 1;
+
+  if (asprintf(&tmppath, "%s.%d", filename, (int)getpid()) == -1)
+    return;
+  fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    fprintf(stderr, "Failure opening '%s' for write: %s\n", tmppath,
+            strerror(errno));
+    free(tmppath);
+    return;
+  }
+
+  memcpy(header.magic, JOURNAL_MAGIC, 4);
+  header.format = JOURNAL_FORMAT;
+  ok = write(fd, &header, sizeof(header)) == sizeof(header);
+  size = sizeof(header);
+
+  g_hash_table_iter_init(&iter, recordings);
+  while (ok && g_hash_table_iter_next(&iter, NULL, &value)) {
+    GByteArray *record = journal_encode(value, JOURNAL_MACRO);
+    ok = write(fd, record->data, record->len) == record->len;
+    size += record->len;
+    g_byte_array_free(record, TRUE);
+  }
+
+  ok = ok && fsync(fd) == 0;
+  ok = (close(fd) == 0) && ok;
+  if (ok && rename(tmppath, filename) == 0) {
+    journal_end = size;
+    journal_records = g_hash_table_size(recordings);
+  } else {
+    fprintf(stderr, "Failure compacting recordings into '%s': %s\n",
+            filename, strerror(errno));
+    unlink(tmppath);
+  }
+  free(tmppath);
+}
+
+/* Compact once stale records outnumber live ones by enough to matter */
+void recordings_maybe_compact(const char *filename) {
+  if (journal_records > 2 * g_hash_table_size(recordings) + 32)
+    recordings_compact(filename);
+}
+
+/* Start a new journal when the file on disk is not one we can append to.
+ * Anything already there is renamed aside rather than overwritten, and the
+ * live macros are written to the new journal. Returns 0 if the journal is
+ * still unusable. */
+int recordings_reset(const char *filename) {
+  struct stat st;
+  char *oldpath;
+
+  if (stat(filename, &st) == -1 || st.st_size == 0)
+    return 1; /* Nothing to keep; the append writes the header */
+
+  if (asprintf(&oldpath, "%s.%ld.old", filename, (long)time(NULL)) == -1)
+    return 0;
+  if (rename(filename, oldpath) == -1) {
+    fprintf(stderr, "Not saving the recording: failure moving '%s' aside: "
+            "%s\n", filename, strerror(errno));
+    free(oldpath);
+    return 0;
   }
+  fprintf(stderr, "Moved the unusable recordings file '%s' to '%s'\n",
+          filename, oldpath);
+  free(oldpath);
 
-  fclose(output);
+  recordings_compact(filename);
+  return journal_end >= sizeof(journal_header_t);
 }
 
-void parse_recordings(const char *filename) {
-  FILE *fp = fopen(filename, "r");
-  if (fp == NULL)
+/* Append rec to the journal; an empty recording deletes the macro */
+void recordings_append(const char *filename, const recording_t *rec) {
+  journal_header_t header;
+  GByteArray *record;
+  struct stat st;
+  int fd;
+
+  if (journal_end < sizeof(journal_header_t) && !recordings_reset(filename))
     return;
 
+  fd = open(filename, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    fprintf(stderr, "Failure opening '%s' for write: %s\n", filename, strerror(errno));
+    if (fd != -1)
+      close(fd);
+    return; /* Should we exit instead? */
+  }
+
+  if (st.st_size == 0) {
+    memcpy(header.magic, JOURNAL_MAGIC, 4);
+    header.format = JOURNAL_FORMAT;
+    if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+      close(fd);
+      return;
+    }
+    journal_end = sizeof(header);
+    journal_records = 0;
+  } else if (st.st_size != journal_end) {
+    /* Drop a torn record left by a crash so the new one is reachable */
+    if (ftruncate(fd, journal_end) == -1) {
+      perror("ftruncate");
+      close(fd);
+      return;
+    }
+  }
+
+  record = journal_encode(rec, rec->commands->len > 0 ? JOURNAL_MACRO
+                                                      : JOURNAL_DELETE);
+  if (pwrite(fd, record->data, record->len, journal_end) == record->len
+      && fdatasync(fd) == 0) {
+    journal_end += record->len;
+    journal_records++;
+  } else {
+    fprintf(stderr, "Failure writing to '%s': %s\n", filename, strerror(errno));
+  }
+  g_byte_array_free(record, TRUE);
+  close(fd);
+
+  recordings_maybe_compact(filename);
+}
+
+/* Read recordings written before the journal: one "keycode commands" line
+ * per macro */
+void recordings_load_legacy(FILE *fp) {
   static const int bufsize = 8192;
   char line[bufsize];
   /* fopen succeeded */
@@ -1973,9 +4869,76 @@ void parse_recordings(const char *filename) {
     rec->keycode = keycode;
     rec->commands = g_ptr_array_new();
     g_ptr_array_add(rec->commands, (gpointer) strdup(command));
-    g_ptr_array_add(recordings, (gpointer) rec);
+    recording_store(rec);
   }
-  fclose(fp);
+}
+
+void recordings_load(const char *filename) {
+  const journal_header_t *header;
+  const char *data;
+  struct stat st;
+  off_t pos;
+  int fd;
+
+  journal_end = 0;
+  journal_records = 0;
+
+  fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return;
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    close(fd);
+    return;
+  }
+
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    close(fd);
+    return;
+  }
+
+  header = (const journal_header_t *)data;
+  if (st.st_size < sizeof(*header) || memcmp(header->magic, JOURNAL_MAGIC, 4)) {
+    /* The old text format; convert it */
+    FILE *fp = fdopen(fd, "r");
+    munmap((void *)data, st.st_size);
+    if (fp == NULL) {
+      close(fd);
+      return;
+    }
+    recordings_load_legacy(fp);
+    fclose(fp);
+    recordings_compact(filename);
+    return;
+  }
+  close(fd);
+
+  if (header->format != JOURNAL_FORMAT) {
+    fprintf(stderr, "Recordings file '%s' has unknown format %u; "
+            "not using it\n", filename, header->format);
+    munmap((void *)data, st.st_size);
+    return;
+  }
+
+  pos = sizeof(*header);
+  while (st.st_size - pos >= sizeof(journal_record_t)) {
+    journal_record_t record;
+    memcpy(&record, data + pos, sizeof(record));
+    if (st.st_size - pos - sizeof(record) < record.length
+        || crc32_update(0, data + pos + sizeof(record), record.length) != record.crc
+        || journal_apply(data + pos + sizeof(record), record.length) != 0)
+      break;
+    pos += sizeof(record) + record.length;
+    journal_records++;
+  }
+  journal_end = pos;
+  munmap((void *)data, st.st_size);
+
+  if (pos < st.st_size) {
+    fprintf(stderr, "Ignoring %ld bytes of incomplete recording data at the "
+            "end of '%s'\n", (long)(st.st_size - pos), filename);
+  }
+  recordings_maybe_compact(filename);
 }
 
 void openpixel(Display *dpy, Window zone, mouseinfo_t *mouseinfo) {
@@ -1983,6 +4946,10 @@ void openpixel(Display *dpy, Window zone, mouseinfo_t *mouseinfo) {
   if (mouseinfo->x == -1 && mouseinfo->y == -1) {
     return;
   }
+  /* An ARGB overlay takes no input at all */
+  if (overlay != NULL && overlay->zone == zone && overlay->argb) {
+    return;
+  }
 
   rect.x = mouseinfo->x;
   rect.y = mouseinfo->y;
@@ -1991,6 +4958,8 @@ void openpixel(Display *dpy, Window zone, mouseinfo_t *mouseinfo) {
 
   XShapeCombineRectangles(dpy, zone, ShapeBounding, 0, 0, &rect, 1,
                           ShapeSubtract, 0);
+  if (overlay != NULL && overlay->zone == zone)
+    shape_touch(overlay, &rect);
 } /* void openpixel */
 
 void closepixel(Display *dpy, Window zone, mouseinfo_t *mouseinfo) {
@@ -1998,6 +4967,9 @@ void closepixel(Display *dpy, Window zone, mouseinfo_t *mouseinfo) {
   if (mouseinfo->x == -1 && mouseinfo->y == -1) {
     return;
   }
+  if (overlay != NULL && overlay->zone == zone && overlay->argb) {
+    return;
+  }
 
   rect.x = mouseinfo->x;
   rect.y = mouseinfo->y;
@@ -2006,8 +4978,286 @@ void closepixel(Display *dpy, Window zone, mouseinfo_t *mouseinfo) {
 
   XShapeCombineRectangles(dpy, zone, ShapeBounding, 0, 0, &rect, 1,
                           ShapeUnion, 0);
+  if (overlay != NULL && overlay->zone == zone)
+    shape_touch(overlay, &rect);
 } /* void closepixel */
 
+/* Running keynav listens on a UNIX socket per display, so that
+ * "keynav 'start, grid 3x3'" from a window manager binding can hand its
+ * commands to the warm process instead of connecting to X and loading the
+ * configuration itself. A client writes one command string and reads the
+ * reply: "ok", "error", or for 'status', the current state as JSON.
+ *
+ * The socket runs commands, 'sh' included, so only its owner may use it:
+ * it lives in a directory only the user can enter, clients check who owns
+ * the socket, and keynav checks who connected. */
+#define CONTROL_MAX_COMMAND 4096
+
+static int control_fd = -1;
+static char *control_path = NULL;
+
+/* $XDG_RUNTIME_DIR/keynav-<display>.sock, or the same name in a per-user
+ * /tmp/keynav-<uid> directory */
+char *control_socket_path(const char *display) {
+  const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+  char *path, *p;
+  char *name;
+  int ret;
+
+  if (asprintf(&name, "keynav-%s.sock", display) == -1)
+    return NULL;
+  for (p = name; *p != '\0'; p++) {
+    if (*p == '/')
+      *p = '_';
+  }
+
+  if (runtime_dir != NULL && *runtime_dir != '\0') {
+    ret = asprintf(&path, "%s/%s", runtime_dir, name);
+  } else {
+    ret = asprintf(&path, "/tmp/keynav-%d/%s", (int)getuid(), name);
+  }
+  free(name);
+  return (ret == -1) ? NULL : path;
+}
+
+/* Whether the directory holding path belongs to us and no one else can
+ * enter it. With create, make it first if it is missing. */
+int control_dir_private(const char *path, int create) {
+  char *dir = g_path_get_dirname(path);
+  struct stat st;
+  int ok;
+
+  if (create && mkdir(dir, 0700) == -1 && errno != EEXIST) {
+    fprintf(stderr, "Can't create %s: %s\n", dir, strerror(errno));
+    g_free(dir);
+    return 0;
+  }
+
+  ok = lstat(dir, &st) == 0 && S_ISDIR(st.st_mode)
+       && st.st_uid == getuid() && (st.st_mode & 077) == 0;
+  if (!ok && create) {
+    fprintf(stderr, "Not using %s for the control socket: it must be a "
+            "directory owned by you with mode 0700\n", dir);
+  }
+  g_free(dir);
+  return ok;
+}
+
+int control_connect(const char *path) {
+  struct sockaddr_un addr;
+  struct stat st;
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return -1;
+
+  /* Never hand commands to a socket someone else made */
+  if (!control_dir_private(path, False) || lstat(path, &st) == -1
+      || !S_ISSOCK(st.st_mode) || st.st_uid != getuid())
+    return -1;
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Write to a control connection. The other end may already be gone, and
+ * that must not kill us with SIGPIPE. SIGPIPE itself stays at its default
+ * so programs run by 'sh' inherit the usual behaviour. */
+int control_write(int fd, const char *buf, size_t len) {
+#ifdef MSG_NOSIGNAL
+  return send(fd, buf, len, MSG_NOSIGNAL) == (ssize_t)len;
+#else /* macOS has SO_NOSIGPIPE instead */
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+  return send(fd, buf, len, 0) == (ssize_t)len;
+#endif
+}
+
+/* Client side: send commands to a running keynav and print its reply.
+ * Returns -1 if nothing is listening, otherwise an exit status. */
+int control_send(const char *path, const char *commands) {
+  char buf[CONTROL_MAX_COMMAND];
+  size_t len = strlen(commands);
+  ssize_t bytes;
+  int fd;
+  int status = EXIT_SUCCESS;
+  int first = 1;
+
+  fd = control_connect(path);
+  if (fd == -1)
+    return -1;
+
+  if (!control_write(fd, commands, len)) {
+    close(fd);
+    return -1;
+  }
+  shutdown(fd, SHUT_WR);
+
+  while ((bytes = read(fd, buf, sizeof(buf))) > 0) {
+    if (first && bytes >= 5 && !strncmp(buf, "error", 5))
+      status = EXIT_FAILURE;
+    if (!(first && bytes == 3 && !strncmp(buf, "ok\n", 3)))
+      fwrite(buf, 1, bytes, stdout);
+    first = 0;
+  }
+  close(fd);
+  return status;
+}
+
+void control_close() {
+  if (control_fd == -1)
+    return;
+  close(control_fd);
+  unlink(control_path);
+  control_fd = -1;
+}
+
+/* Server side: start listening unless another keynav already is */
+void control_listen(const char *path) {
+  struct sockaddr_un addr;
+  mode_t mask;
+  int fd, ret;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Control socket path too long: %s\n", path);
+    return;
+  }
+  if (!control_dir_private(path, True))
+    return;
+
+  fd = control_connect(path);
+  if (fd != -1) {
+    fprintf(stderr, "Another keynav is listening on %s; not taking over\n",
+            path);
+    close(fd);
+    return;
+  }
+  unlink(path); /* left behind by a keynav that didn't exit cleanly */
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    perror("socket");
+    return;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  mask = umask(077);
+  ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+  if (ret == -1 || listen(fd, 8) == -1) {
+    fprintf(stderr, "Can't listen on %s: %s\n", path, strerror(errno));
+    close(fd);
+    return;
+  }
+
+  control_fd = fd;
+  control_path = strdup(path);
+  atexit(control_close);
+}
+
+void control_write_status(int fd) {
+  char *json;
+  int len;
+
+  len = asprintf(&json,
+                 "{\"pid\": %d, \"active\": %s, \"dragging\": %s, "
+                 "\"recording\": %s, \"playback\": %s, \"grid_nav\": %s, "
+                 "\"wininfo\": {\"x\": %d, \"y\": %d, \"w\": %d, \"h\": %d, "
+                 "\"grid_rows\": %d, \"grid_cols\": %d, "
+                 "\"border_thickness\": %d, \"center_cut_size\": %d, "
+                 "\"viewport\": %d}}\n",
+                 (int)getpid(),
+                 ISACTIVE ? "true" : "false",
+                 ISDRAGGING ? "true" : "false",
+                 appstate.recording != record_off ? "true" : "false",
+                 appstate.playback ? "true" : "false",
+                 appstate.grid_nav ? "true" : "false",
+                 wininfo.x, wininfo.y, wininfo.w, wininfo.h,
+                 wininfo.grid_rows, wininfo.grid_cols,
+                 wininfo.border_thickness, wininfo.center_cut_size,
+                 wininfo.curviewport);
+  if (len == -1)
+    return;
+  if (!control_write(fd, json, len))
+    perror("send");
+  free(json);
+}
+
+/* Handle one client on the control socket */
+/* Whether the client on fd runs as our user */
+int control_peer_is_us(int fd) {
+#ifdef __linux__
+  struct ucred peer;
+  socklen_t peerlen = sizeof(peer);
+
+  return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &peerlen) == 0
+         && peer.uid == getuid();
+#else
+  uid_t uid;
+  gid_t gid;
+
+  return getpeereid(fd, &uid, &gid) == 0 && uid == getuid();
+#endif
+}
+
+void control_accept() {
+  char command[CONTROL_MAX_COMMAND];
+  struct timeval timeout = { 0, 100000 };
+  size_t len = 0;
+  ssize_t bytes;
+  int fd;
+
+  fd = accept(control_fd, NULL, NULL);
+  if (fd == -1)
+    return;
+  if (!control_peer_is_us(fd)) {
+    fprintf(stderr, "Refusing a control connection from another user\n");
+    close(fd);
+    return;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC); /* 'restart' must not hold the client */
+
+  /* Don't let a client that never finishes writing hang keynav */
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  while (len < sizeof(command) - 1
+         && (bytes = read(fd, command + len, sizeof(command) - 1 - len)) > 0) {
+    len += bytes;
+  }
+  command[len] = '\0';
+  while (len > 0 && isspace(command[len - 1]))
+    command[--len] = '\0';
+
+  /* Nothing sent, such as another keynav checking whether we are here */
+  if (len == 0) {
+    close(fd);
+    return;
+  }
+
+  if (!strcmp(command, "status")) {
+    control_write_status(fd);
+  } else if (handle_commands(command) == 0) {
+    if (!control_write(fd, "ok\n", 3))
+      perror("send");
+  } else {
+    if (!control_write(fd, "error\n", 6))
+      perror("send");
+  }
+  close(fd);
+}
+
+#ifndef KEYNAV_NO_MAIN
 int main(int argc, char **argv) {
   char *pcDisplay;
   int ret;
@@ -2020,10 +5270,26 @@ int main(int argc, char **argv) {
     return EXIT_FAILURE;
   }
 
+  /* Hand the commands to a running keynav if there is one. 'daemonize'
+   * always means starting a new process. */
+  char *socket_path = control_socket_path(pcDisplay);
+  if (socket_path != NULL && argc == 2 && strstr(argv[1], "daemonize") == NULL
+      && strcmp(argv[1], "version") && strcmp(argv[1], "-v")
+      && strcmp(argv[1], "--version")) {
+    ret = control_send(socket_path, argv[1]);
+    if (ret != -1)
+      return ret;
+    if (!strcmp(argv[1], "status")) {
+      fprintf(stderr, "keynav is not running on %s\n", pcDisplay);
+      return EXIT_FAILURE;
+    }
+  }
+
   if ((dpy = XOpenDisplay(pcDisplay)) == NULL) {
     fprintf(stderr, "Error: Can't open display: %s\n", pcDisplay);
     return EXIT_FAILURE;
   }
+  xcb = XGetXCBConnection(dpy);
 
   if (argc > 1 && (!strcmp(argv[1], "version")
                    || !strcmp(argv[1], "-v")
@@ -2036,8 +5302,20 @@ int main(int argc, char **argv) {
   signal(SIGHUP, sighup);
   signal(SIGUSR1, sighup);
   xdo = xdo_new_with_opened_display(dpy, pcDisplay, False);
+  {
+    int xtest_event, xtest_error, xtest_major, xtest_minor;
+    have_xtest = XTestQueryExtension(dpy, &xtest_event, &xtest_error,
+                                     &xtest_major, &xtest_minor);
+  }
+  compositors_query();
 
   parse_config();
+
+  /* A start key we can't grab would never work; fail before daemonizing */
+  if (grab_checks_collect() > 0) {
+    fprintf(stderr, "Fix or remove the bindings above and try again.\n");
+    return EXIT_FAILURE;
+  }
   query_screens();
 
   if (argc == 2) {
@@ -2050,7 +5328,7 @@ int main(int argc, char **argv) {
   }
 
   /* Sync with the X server.
-   * This ensure we errors about XGrabKey and other failures
+   * This ensure we see errors about startup commands and other failures
    * before we try to daemonize */
   XSync(dpy, 0);
 
@@ -2060,7 +5338,23 @@ int main(int argc, char **argv) {
   int xrandr_error_base = 0;
   int xrandr = XRRQueryExtension (dpy, &xrandr_event_base, &xrandr_error_base);
   if (xrandr) {
-    XRRSelectInput(dpy, DefaultRootWindow(dpy), RRScreenChangeNotifyMask);
+    XRRSelectInput(dpy, DefaultRootWindow(dpy), RRScreenChangeNotifyMask
+                   | RRCrtcChangeNotifyMask | RROutputChangeNotifyMask);
+  }
+
+  /* Events that hint another client released its keyboard grab, so a
+   * pending grab can be retried (see grab_keyboard) */
+  int screen;
+  for (screen = 0; screen < ScreenCount(dpy); screen++) {
+    XSelectInput(dpy, RootWindow(dpy, screen), FocusChangeMask);
+  }
+  int xkb_opcode, xkb_error_base, xkb_major = XkbMajorVersion,
+      xkb_minor = XkbMinorVersion;
+  if (XkbQueryExtension(dpy, &xkb_opcode, &xkb_event_base, &xkb_error_base,
+                        &xkb_major, &xkb_minor)) {
+    XkbSelectEventDetails(dpy, XkbUseCoreKbd, XkbStateNotify,
+                          XkbAllStateComponentsMask,
+                          XkbModifierStateMask | XkbGroupStateMask);
   }
 
   if (daemonize) {
@@ -2069,56 +5363,154 @@ int main(int argc, char **argv) {
     is_daemon = True;
   }
 
+  if (socket_path != NULL)
+    control_listen(socket_path);
+
   while (1) {
     XEvent e;
+
+    /* Handle every event already queued before drawing, so a burst of
+     * events costs one frame. Idle time after that goes to drawing the
+     * frames the next key is likely to need. */
+    if (!XPending(dpy)) {
+      /* Monitor changes arrive as a burst of events; look once at the end */
+      if (screens_changed) {
+        screens_changed = 0;
+        query_screens();
+        continue;
+      }
+      if (appstate.need_frame) {
+        frame_commit();
+        continue;
+      }
+      /* The keys handled so far needed no frame */
+      keypress_time_us = 0;
+      if (speculate_next >= 0) {
+        speculate();
+        continue;
+      }
+
+      /* Report keys that a runtime 'loadconfig' failed to grab */
+      if (grab_checks != NULL && grab_checks->len > 0) {
+        grab_checks_collect();
+      }
+
+      /* Nothing left to do: sleep until X or a control client needs us.
+       * While a keyboard grab is pending, wake up every GRAB_POLL_US (and
+       * at the deadline) so grab_retry runs even if no event hints that
+       * the other grab is gone. */
+      int xfd = ConnectionNumber(dpy);
+      int maxfd = MAX(xfd, control_fd);
+      struct timeval tv, *timeout = NULL;
+      fd_set fds;
+
+      FD_ZERO(&fds);
+      FD_SET(xfd, &fds);
+      if (control_fd != -1)
+        FD_SET(control_fd, &fds);
+      if (grab_pending) {
+        long long wait_us = MIN(MAX(grab_deadline_us - now_us(), 0),
+                                GRAB_POLL_US);
+        tv.tv_sec = wait_us / 1000000;
+        tv.tv_usec = wait_us % 1000000;
+        timeout = &tv;
+      }
+
+      ret = select(maxfd + 1, &fds, NULL, NULL, timeout);
+      if (ret == 0) {
+        grab_retry();
+      } else if (ret > 0 && control_fd != -1 && FD_ISSET(control_fd, &fds)) {
+        control_accept();
+      }
+      continue;
+    }
+
     XNextEvent(dpy, &e);
 
     switch (e.type) {
       case KeyPress:
         handle_keypress((XKeyEvent *)&e);
+        keypress_pointer.valid = 0;
         break;
 
       /* MapNotify means the keynav window is now visible */
+      /* Our own map and configure requests need nothing more; only react
+       * when someone else changed the window */
       case MapNotify:
-        update();
+        if (overlay == NULL || e.xmap.window != overlay->zone
+            || !overlay->mapped) {
+          update();
+        }
         break;
 
       // Configure events mean the window was changed (size, property, etc)
       case ConfigureNotify:
-        update();
+        if (overlay == NULL || e.xconfigure.window != overlay->zone
+            || e.xconfigure.x != overlay->shown.x
+            || e.xconfigure.y != overlay->shown.y
+            || e.xconfigure.width != overlay->shown.w
+            || e.xconfigure.height != overlay->shown.h) {
+          update();
+        }
         break;
 
       case Expose:
-        if (zone) {
-        XCopyArea(dpy, canvas, zone, canvas_gc, e.xexpose.x, e.xexpose.y,
+        if (overlay) {
+        XCopyArea(dpy, overlay->front, overlay->zone, overlay->canvas_gc,
+                  e.xexpose.x, e.xexpose.y,
                   e.xexpose.width, e.xexpose.height,
                   e.xexpose.x, e.xexpose.y);
         }
         break;
 
       case MotionNotify:
-        if (zone) {
+        if (overlay) {
         if (mouseinfo.x != -1 && mouseinfo.y != -1) {
-          closepixel(dpy, zone, &mouseinfo);
+          closepixel(dpy, overlay->zone, &mouseinfo);
         }
         mouseinfo.x = e.xmotion.x;
         mouseinfo.y = e.xmotion.y;
-        openpixel(dpy, zone, &mouseinfo);
+        openpixel(dpy, overlay->zone, &mouseinfo);
         }
         break;
 
+      /* Another client's keyboard grab may have just ended */
+      case KeyRelease:
+        grab_retry();
+        break;
+
+      /* When a grab on the root ends, the root sees focus move back from
+       * the grab window: a FocusOut, or a FocusIn under PointerRoot focus,
+       * both with mode NotifyUngrab */
+      case FocusIn:
+      case FocusOut:
+        if (e.xfocus.mode == NotifyUngrab)
+          grab_retry();
+        break;
+
       // Ignorable events.
       case GraphicsExpose:
       case NoExpose:
       case LeaveNotify:   // Mouse left the window
-      case KeyRelease:    // key was released
       case DestroyNotify: // window was destroyed
       case UnmapNotify:   // window was unmapped (hidden)
+        break;
+
       case MappingNotify: // when keyboard mapping changes
+        XRefreshKeyboardMapping(&e.xmapping);
+        label_keys_generation = -1;
         break;
       default:
         if (e.type == xrandr_event_base + RRScreenChangeNotify) {
-          query_screens();
+          XRRUpdateConfiguration(&e);
+          screens_changed = 1;
+        } else if (e.type == xrandr_event_base + RRNotify) {
+          screens_changed = 1;
+        } else if (e.type == xkb_event_base) {
+          grab_retry();
+        } else if (xfixes_event_base >= 0
+                   && e.type == xfixes_event_base + XFixesSelectionNotify) {
+          compositor_changed((XFixesSelectionNotifyEvent *)&e);
         } else {
           printf("Unexpected X11 event: %d\n", e.type);
         }
@@ -2128,3 +5520,4 @@ int main(int argc, char **argv) {
 
   xdo_free(xdo);
 } /* int main */
+#endif /* KEYNAV_NO_MAIN */